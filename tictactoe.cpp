@@ -11,6 +11,31 @@
 #include <utility>
 #include <iomanip>
 #include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory_resource>
+#include <cmath>
+#include <string_view>
+#include <algorithm>
+#include <coroutine>
+#include <optional>
+#include <limits>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 using std::ostream;
 using std::vector;
@@ -28,11 +53,144 @@ using std::stringstream;
 using std::unique_ptr;
 using std::unordered_set;
 using std::unordered_map;
+using std::shared_ptr;
+using std::make_shared;
+using std::ofstream;
+using std::ios;
+using std::ifstream;
+using std::atomic;
+using std::thread;
+using std::string_view;
 
 static const int TIE = 0;
 static const int PLAYING = -1;
 static const int EMPTY = 0;
+static const uint32_t N_POSITION_CODES = 19683;
+static const uint32_t POSITION_POWERS[9] = {
+	1, 3, 9, 27, 81, 243, 729, 2187, 6561};
 static random_device global_rng;
+static std::mutex global_rng_mutex;
+
+// Seconds between checkpoint writes of a score run given --checkpoint.
+static const int CHECKPOINT_SECONDS = 10;
+
+// Level of tracing printed by players, set by --verbose.
+static int verbosity = 0;
+
+// Whether search players ponder on the opponent's turn, set by --ponder.
+static bool ponder_enabled = false;
+
+// Name of the shared memory position cache of the search players, set by
+// --shared-cache.
+static string shared_cache_name;
+
+// Continuations played by the search players, read by the progress reporter.
+static atomic<uint64_t> rollouts_played(0);
+
+
+// Seed stream of the game being played on this thread, when the run has a
+// seed.  Players then get their seeds from the run seed and game index alone.
+static thread_local std::mt19937* seed_stream = nullptr;
+
+// Seed from the thread's seed stream if set, else from global_rng mixed with
+// the clock, safe to call from any thread.
+unsigned int fresh_seed() {
+	if (seed_stream) {
+		return (*seed_stream)();
+	}
+	std::lock_guard<std::mutex> lock(global_rng_mutex);
+	return global_rng() + system_clock::now().time_since_epoch().count();
+}
+
+// Makes fresh_seed() draw from a stream seeded with seed on this thread
+// while in scope.
+class SeedScope {
+public:
+	explicit SeedScope(uint64_t seed) :
+			previous(seed_stream) {
+		std::seed_seq seq{
+			static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)};
+		stream.seed(seq);
+		seed_stream = &stream;
+	}
+	
+	~SeedScope() {
+		seed_stream = previous;
+	}
+	
+	SeedScope(const SeedScope&) = delete;
+	SeedScope& operator=(const SeedScope&) = delete;
+	
+private:
+	std::mt19937 stream;
+	std::mt19937* previous;
+};
+
+// Seed of one game of a seeded run, so any shard or resumed run plays the
+// game the same way.
+uint64_t game_seed(uint64_t run_seed, uint64_t game_index) {
+	// splitmix64 finalizer.
+	uint64_t z = run_seed + (game_index + 1)*0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// Allocation accounting, turned on by --track-allocs.  The replaced global
+// operator new counts each allocation into the counter active on the calling
+// thread and every counter that one is nested in.
+struct AllocationCounter {
+	atomic<uint64_t> count;
+	atomic<uint64_t> bytes;
+	AllocationCounter* parent;
+	
+	AllocationCounter() :
+			count(0),
+			bytes(0),
+			parent(nullptr) {}
+	
+	void reset() {
+		count = 0;
+		bytes = 0;
+	}
+};
+
+static bool alloc_tracking_enabled = false;
+static AllocationCounter global_allocations;
+static thread_local AllocationCounter* current_allocation_counter = nullptr;
+
+// Nests counter inside the thread's active counter until the scope ends.
+class AllocationScope {
+public:
+	AllocationScope(AllocationCounter& counter) :
+			previous(current_allocation_counter) {
+		counter.parent = previous;
+		current_allocation_counter = &counter;
+	}
+	
+	~AllocationScope() {
+		current_allocation_counter = previous;
+	}
+	
+private:
+	AllocationCounter* previous;
+};
+
+// Counts a task's allocations where the task was submitted, not where it runs.
+class AllocationContext {
+public:
+	AllocationContext(AllocationCounter* counter) :
+			previous(current_allocation_counter) {
+		current_allocation_counter = counter;
+	}
+	
+	~AllocationContext() {
+		current_allocation_counter = previous;
+	}
+	
+private:
+	AllocationCounter* previous;
+};
 
 
 // Manipulation for player values of 1 and 2.
@@ -46,10 +204,15 @@ int other_player_index(int p) {
 }
 
 
+// Packed into one byte, print fields through int since they are chars.
 class Move {
 public:
-	int position;
-	int player;
+	uint8_t position : 4;
+	uint8_t player : 2;
+	
+	Move() :
+			position(0),
+			player(0) {}
 	
 	Move(int pos, int p) :
 			position(pos),
@@ -58,18 +221,106 @@ public:
 	friend ostream& operator<<(ostream& os, const Move& m);
 };
 
+static_assert(sizeof(Move) == 1, "Move should pack into one byte.");
+
+
+// List of moves stored inline with a fixed capacity, so game records can be
+// created and copied without touching the heap.
+template <typename M, int Capacity>
+class MoveRecord {
+public:
+	MoveRecord() :
+			n_moves(0) {}
+	
+	void push_back(M m) {
+		moves[n_moves++] = m;
+	}
+	
+	void clear() {
+		n_moves = 0;
+	}
+	
+	int size() const {
+		return n_moves;
+	}
+	
+	bool empty() const {
+		return n_moves == 0;
+	}
+	
+	M operator[](int i) const {
+		return moves[i];
+	}
+	
+	const M* begin() const {
+		return moves.data();
+	}
+	
+	const M* end() const {
+		return moves.data() + n_moves;
+	}
+	
+private:
+	array<M, Capacity> moves;
+	uint8_t n_moves;
+};
+
+// A whole 3x3 game in ten bytes.
+typedef MoveRecord<Move, 9> GameRecord;
+typedef MoveRecord<Move, 9> MoveList;
+
+
+// Rows, columns and diagonals of a 3x3 grid as 9 bit masks.
+static const uint16_t LINE_MASKS[8] = {
+	0007, 0070, 0700, 0111, 0222, 0444, 0421, 0124};
+static const uint16_t FULL_MASK = 0777;
+
+static const array<uint8_t, 512> LINE_TABLE = [] {
+	array<uint8_t, 512> table{};
+	for (int mask = 0; mask < 512; mask++) {
+		for (uint16_t line : LINE_MASKS) {
+			table[mask] |= (mask & line) == line;
+		}
+	}
+	return table;
+}();
+
+// For each occupancy mask of one player, the squares that would complete a
+// line for that player.  Masking with the empty squares gives immediate wins.
+static const array<uint16_t, 512> THREAT_TABLE = [] {
+	array<uint16_t, 512> table{};
+	for (int mask = 0; mask < 512; mask++) {
+		for (uint16_t line : LINE_MASKS) {
+			uint16_t missing = line & ~mask;
+			if (__builtin_popcount(missing) == 1) {
+				table[mask] |= missing;
+			}
+		}
+	}
+	return table;
+}();
 
 class Board {
 public:	
 	Board() : 
-			board(9, 0),
+			board{},
+			masks{},
+			code(0),
 			status(PLAYING),
 			m_next_player(1) {}
 		
 	Board(const vector<int>& b) : 
+			masks{},
+			code(0),
 			status(PLAYING),
 			m_next_player(1){
-		board = b;
+		for (int i = 0; i < 9; i++) {
+			board[i] = b[i];
+			code += b[i]*POSITION_POWERS[i];
+			if (b[i] != EMPTY) {
+				masks[b[i] - 1] |= 1 << i;
+			}
+		}
 		update_status();
 		for (int pos : b) {
 			if (pos > 0) {
@@ -99,12 +350,14 @@ public:
 	
 	void apply_move(Move m) {
 		board[m.position] = m.player;
+		masks[m.player - 1] |= 1 << m.position;
+		code += m.player*POSITION_POWERS[m.position];
 		update_status();
 		m_next_player = other_player(m_next_player);
 	}
 	
-	vector<Move> valid_moves(int player) const {
-		vector<Move> moves;
+	MoveList valid_moves(int player) const {
+		MoveList moves;
 		
 		for (int i = 0; i < 9; i++) {
 			if (board[i] == EMPTY) {
@@ -123,8 +376,29 @@ public:
 		return m_next_player - 1;
 	}
 
+	// Base 3 encoding of the board, cell i contributes player * 3^i.  Kept
+	// up to date by apply_move.
+	uint32_t position_code() const {
+		return code;
+	}
+	
+	// Dense index of the position among those reachable in play, NO_RANK
+	// for a board set up some other way.
+	uint16_t position_rank() const;
+
+	// Squares held by a player as a 9 bit mask, bit i for position i.
+	uint16_t player_mask(int player) const {
+		return masks[player - 1];
+	}
+	
+	uint16_t empty_mask() const {
+		return FULL_MASK & ~(masks[0] | masks[1]);
+	}
+
 private:
-	vector<int> board;
+	array<uint8_t, 9> board;
+	array<uint16_t, 2> masks;
+	uint16_t code;
 	int status;
 	int m_next_player;
 	
@@ -132,27 +406,119 @@ private:
 };
 
 
+// Positions reachable in play from the empty board, counting finished games,
+// ranked in position code order so tables of them can be plain arrays.
+static const uint32_t N_POSITION_RANKS = 5478;
+static const uint16_t NO_RANK = 0xffff;
+
+static const array<uint16_t, N_POSITION_CODES> RANK_OF_CODE = [] {
+	array<uint16_t, N_POSITION_CODES> ranks;
+	ranks.fill(NO_RANK);
+	ranks[0] = 0;
+	vector<Board> open = {Board()};
+	while (!open.empty()) {
+		Board b = open.back();
+		open.pop_back();
+		if (!b.is_playing()) {
+			continue;
+		}
+		for (Move m : b.valid_moves(b.next_player())) {
+			Board next_board = b;
+			next_board.apply_move(m);
+			if (ranks[next_board.position_code()] == NO_RANK) {
+				ranks[next_board.position_code()] = 0;
+				open.push_back(next_board);
+			}
+		}
+	}
+	uint16_t rank = 0;
+	for (uint16_t& r : ranks) {
+		if (r != NO_RANK) {
+			r = rank++;
+		}
+	}
+	return ranks;
+}();
+
+static const array<uint32_t, N_POSITION_RANKS> CODE_OF_RANK = [] {
+	array<uint32_t, N_POSITION_RANKS> codes{};
+	for (uint32_t code = 0; code < N_POSITION_CODES; code++) {
+		if (RANK_OF_CODE[code] != NO_RANK) {
+			codes[RANK_OF_CODE[code]] = code;
+		}
+	}
+	return codes;
+}();
+
+inline uint16_t Board::position_rank() const {
+	return RANK_OF_CODE[code];
+}
+
+
+// A move a player may make and the chance that it does.
+struct WeightedMove {
+	Move move;
+	double probability;
+};
+
+typedef MoveRecord<WeightedMove, 9> MoveDistribution;
+
+
+// Outcome chances for player one and expected moves left from a position.
+struct ExactOutcome {
+	double win = 0;
+	double loss = 0;
+	double tie = 0;
+	double moves = 0;
+};
+
+
 class Player {
 	public:
 		virtual ~Player() {};
 		virtual Move next_move(const Board&) = 0;
+		
+		// Fills moves with every move next_move may return from b and its
+		// probability.  Players whose choice can't be listed return false.
+		virtual bool move_distribution(const Board&, MoveDistribution&) {
+			return false;
+		}
+};
+
+
+// Notified around each Player::next_move call while a game is played.
+class MoveObserver {
+public:
+	virtual ~MoveObserver() {};
+	virtual void before_move(int ply, int player_idx) = 0;
+	virtual void after_move(int ply, int player_idx) = 0;
 };
 
 
 class Tictactoe {
 public:
-	vector<Move> action_log;
+	GameRecord action_log;
 	Board board;
+	MoveObserver* observer;
 	
 	Tictactoe(Player* p1, Player* p2) :
+			observer(nullptr),
 			players({p1, p2}),
 			next_player_idx(0) {}
 			
 	Tictactoe(Player* p1, Player* p2, Board initial) :
 			board(initial), 
+			observer(nullptr),
 			players({p1, p2}),
 			next_player_idx(board.next_player_idx()) {}
 			
+	// Starts over from initial, keeping the players and observer.
+	void restart(const Board& initial) {
+		board = initial;
+		action_log.clear();
+		next_player_idx = board.next_player_idx();
+	}
+	
 	void play();
 	friend ostream& operator<<(ostream& os, const Tictactoe& game);
 	
@@ -168,9 +534,7 @@ public:
 			player(p) {
 		// Use random device to create random sequence for seeds.
 		// Use system clock to get different sequence each time.
-		unsigned int random_seed = 
-			global_rng() + system_clock::now().time_since_epoch().count();
-		seed = random_seed;
+		seed = fresh_seed();
 		generator.seed(seed);
 	}
 		
@@ -180,12 +544,20 @@ public:
 			generator(seed) {}
 
 	virtual Move next_move(const Board& b) {
-		vector<Move> moves = b.valid_moves(player);
+		MoveList moves = b.valid_moves(player);
 		uniform_int_distribution<int> idx_dist(0, size(moves) - 1);
 		int random_index = idx_dist(generator);
 		return moves[random_index];
 	}
 	
+	virtual bool move_distribution(const Board& b, MoveDistribution& moves) {
+		MoveList valid = b.valid_moves(player);
+		for (Move m : valid) {
+			moves.push_back({m, 1.0 / size(valid)});
+		}
+		return true;
+	}
+	
 private:
 	int player;
 	unsigned int seed;
@@ -200,30 +572,37 @@ public:
 			random_alternative(player) {}
 			
 	virtual Move next_move(const Board& b) {
-		vector<Move> moves = b.valid_moves(player);
+		uint16_t empty = b.empty_mask();
 		
 		// Look for winning moves.
-		for (Move m : moves) {
-			Board next_board = b;
-			next_board.apply_move(m);
-			if (next_board.is_won()) {
-				return m;
-			}
+		uint16_t wins = THREAT_TABLE[b.player_mask(player)] & empty;
+		if (wins) {
+			return Move(__builtin_ctz(wins), player);
 		}
 		
 		// Look for blocking moves.
-		int other = other_player(player);
-		for (Move m : moves) {
-			Board next_board = b;
-			next_board.apply_move(Move(m.position, other));
-			if (next_board.is_won()) {
-				return m;
-			}
+		uint16_t blocks = THREAT_TABLE[b.player_mask(other_player(player))] & empty;
+		if (blocks) {
+			return Move(__builtin_ctz(blocks), player);
 		}
 		
 		// Default to a random move.
 		return random_alternative.next_move(b);
 	}
+	
+	// Wins and blocks are taken deterministically, as in next_move.
+	virtual bool move_distribution(const Board& b, MoveDistribution& moves) {
+		uint16_t empty = b.empty_mask();
+		uint16_t forced = THREAT_TABLE[b.player_mask(player)] & empty;
+		if (!forced) {
+			forced = THREAT_TABLE[b.player_mask(other_player(player))] & empty;
+		}
+		if (forced) {
+			moves.push_back({Move(__builtin_ctz(forced), player), 1.0});
+			return true;
+		}
+		return random_alternative.move_distribution(b, moves);
+	}
  
 private:
 	int player;
@@ -231,469 +610,5914 @@ private:
 };
 
 
-class OneStepAheadMCSTPlayer : public Player {
+class TaskGroup;
+
+// Thread pool where each worker owns a deque of tasks.  Workers run their own
+// newest task first and steal the oldest task of another worker when idle.
+// Threads waiting on a TaskGroup run the group's queued tasks instead of
+// blocking, so tasks can start and wait on nested work without extra
+// threads, and a waiter never ends up running unrelated work.
+class WorkStealingPool {
 public:
-	OneStepAheadMCSTPlayer(
-			int p, 
-			int n = 100, 
-			double win  = 1.0, 
-			double tie  = 0.5,
-			double loss = 0.0) : 
-			player(p),
-			n_samples(n),
-			win_score(win),
-			tie_score(tie),
-			loss_score(loss),
-			self(player),
-			opponent(player) {}
-			
-	virtual Move next_move(const Board& b) {
-		// Set initial move scores to zero.
-		vector<Move> moves = b.valid_moves(player);
-		unordered_map<int, double> move_scores;
-		for (Move m : moves) {
-			move_scores.insert({m.position, 0.0});
-		}
-		
-		// Simulate games forward and accumulate scores.
-		for (int i = 0; i < n_samples; i++) {
-			Move next_move = self.next_move(b);
-			Board next_board = b;
-			next_board.apply_move(next_move);
-			
-			Tictactoe continuation(&self, &opponent, next_board);
-			continuation.play();
-			
-			if (continuation.board.is_won()) {
-				if (continuation.board.winning_player() == player) {
-					move_scores[next_move.position] += win_score;
-				} else {
-					move_scores[next_move.position] += loss_score;
-				} 
-			} else {
-				move_scores[next_move.position] += tie_score;
-			}
-		}
-		
-		// Pick highest scoring move.
-		int max_position = moves[0].position;
-		double max_score = move_scores[max_position];
-		for (auto move_score : move_scores) {
-			cout << "Move " << move_score.first
-			     << " Score " << move_score.second
-				 << endl;
-			if (max_score < move_score.second) {
-				max_position = move_score.first;
-				max_score = move_score.second;
-			}
-		}
-		
-		Move selected_move = Move(max_position, player);
-		cout << "Selected " << selected_move << endl;
-		
-		return selected_move;
+	typedef std::function<void()> task_type;
+	
+	explicit WorkStealingPool(int n_threads);
+	~WorkStealingPool();
+	WorkStealingPool(const WorkStealingPool&) = delete;
+	WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+	
+	// Tasks of a group are only run by pool workers or by that group's
+	// waiters.
+	void submit(task_type task, const TaskGroup* group = nullptr);
+	
+	// Runs one queued task on the calling thread, false if none was found.
+	// With a group, only that group's tasks are run.
+	bool run_pending_task(const TaskGroup* group = nullptr);
+	
+	int size() const {
+		return n_workers;
 	}
 	
 private:
-	int player;
-	int n_samples;
-	double win_score;
-	double tie_score;
-	double loss_score;
-	OneStepAheadPlayer self;
-	OneStepAheadPlayer opponent;
+	struct QueuedTask {
+		task_type task;
+		const TaskGroup* group;
+	};
+	
+	struct WorkerQueue {
+		std::mutex mutex;
+		std::deque<QueuedTask> tasks;
+	};
+	
+	// Set before any worker starts, workers read it while workers grows.
+	const int n_workers;
+	vector<unique_ptr<WorkerQueue>> queues;
+	vector<thread> workers;
+	atomic<int> n_queued;
+	atomic<unsigned int> next_queue;
+	std::mutex wake_mutex;
+	std::condition_variable wake;
+	bool stopping;
+	
+	bool pop_task(int queue_index, const TaskGroup* group, task_type& task);
+	bool steal_task(int thief_index, const TaskGroup* group, task_type& task);
+	void worker_loop(int index);
 };
 
 
-
-void test_board_status();
-void test_board_moves();
-void test_random_moves();
-void test_random_game();
-void test();
-void score_players( 
-		string player_one_name, 
-		string player_two_name,
-		int n_games);
-Player* find_player_by_name(string player_name, int player);
-ostream& operator<<(ostream& os, const vector<Move>& moves);
-
-
-class CLIHandler {
+// Tasks submitted to a pool that are waited on together.
+class TaskGroup {
 public:
-	CLIHandler(int argc, char** argv) :
-			n_args(argc),
-			valid_player_names({
-				"random", 
-				"one_step_ahead",
-				"one_step_ahead_mcst"}) {
-		for (int i = 1; i < n_args; i++) {
-			args.push_back(argv[i]);
-		}
-	}
+	TaskGroup(WorkStealingPool& p) :
+			pool(p),
+			pending(0) {}
 	
-	void run_command() {
-		if (n_args < 2) {
-			print_usage();
-		} else if (args[0] == "test") {
-			test();
-		} else if (args[0] == "random") {
-			test_random_game();
-		} else if (args[0] == "score") {
-			run_score();
-		} else {
-			print_usage();
-		}
+	~TaskGroup() {
+		wait();
 	}
 	
-	void run_score() {
-		if (n_args < 5) {
-			print_usage_score();
-		} else {
-			stringstream ss;
-			int n_games;
-			string player_one_name, player_two_name;
-			ss << args[1];
-			ss >> n_games;
-			ss.str("");
-			ss.clear();
-			
-			ss << args[2];
-			ss >> player_one_name;
-			if (valid_player_names.count(player_one_name) == 0) {
-				cerr << "Player one name, "
-				     << player_one_name
-					 << ", not found." << endl;
-				print_usage_score();
-				return;
+	void run(WorkStealingPool::task_type task) {
+		pending++;
+		AllocationCounter* counter = current_allocation_counter;
+		pool.submit([this, task, counter] {
+			{
+				AllocationContext context(counter);
+				task();
 			}
-			ss.str("");
-			ss.clear();
-			
-			ss << args[3];
-			ss >> player_two_name;
-			if (valid_player_names.count(player_two_name) == 0) {
-				cerr << "Player two name, "
-				     << player_two_name
-					 << ", not found." << endl;
-				print_usage_score();
-				return;
+			// Under the lock, so a waiter that sees pending reach 0 and then
+			// takes the lock knows this task is done with the group.
+			std::lock_guard<std::mutex> lock(done_mutex);
+			pending--;
+			done.notify_all();
+		}, this);
+	}
+	
+	// Helps run the group's queued tasks until ready returns true, ready
+	// must become true by a task of this group finishing.  Blocks once the
+	// group's tasks have all been started.
+	template <typename F>
+	void wait_until(F ready) {
+		while (!ready()) {
+			if (!pool.run_pending_task(this)) {
+				std::unique_lock<std::mutex> lock(done_mutex);
+				done.wait_for(lock, std::chrono::milliseconds(1), ready);
 			}
-			ss.str("");
-			ss.clear();
-			
-			score_players(player_one_name, player_two_name, n_games);
 		}
 	}
 	
-	void print_usage();
-	void print_usage_score();
+	// Helps run the group's tasks until every one has finished.  The group
+	// may be destroyed once this returns.
+	void wait() {
+		wait_until([this] { return pending == 0; });
+		std::lock_guard<std::mutex> lock(done_mutex);
+	}
 	
 private:
-	int n_args;
-	vector<string> args;
-	unordered_set<string> valid_player_names;
+	WorkStealingPool& pool;
+	atomic<int> pending;
+	std::mutex done_mutex;
+	std::condition_variable done;
 };
 
 
-int main(int argc, char** argv) {
-	cout << "Tictactoe Engine" << endl;
-	
+// Pool shared by every parallel workload in the engine.  The calling thread
+// helps while it waits, so one thread fewer than the core count is started.
+WorkStealingPool& engine_pool();
+
+
+// Scratch memory for MCST decisions.  A decision builds a monotonic arena
+// over its thread's scratch buffer, which is reset when the decision ends.
+// A decision started while another is under way on the same thread, as
+// when a game runs nested in a waiting game's task, gets a small arena of
+// its own instead.
+static const size_t SCRATCH_BYTES = 1 << 16;
+static thread_local bool scratch_in_use = false;
+static thread_local array<unsigned char, SCRATCH_BYTES> scratch_buffer;
+
+class DecisionArena {
+public:
+	DecisionArena() :
+			owns_scratch(!scratch_in_use),
+			arena(owns_scratch ? scratch_buffer.data() : nested_buffer.data(),
+				owns_scratch ? scratch_buffer.size() : nested_buffer.size()) {
+		scratch_in_use = true;
+	}
+	
+	~DecisionArena() {
+		if (owns_scratch) {
+			scratch_in_use = false;
+		}
+	}
+	
+	DecisionArena(const DecisionArena&) = delete;
+	DecisionArena& operator=(const DecisionArena&) = delete;
+	
+	std::pmr::memory_resource* resource() {
+		return &arena;
+	}
+	
+private:
+	bool owns_scratch;
+	array<unsigned char, 1024> nested_buffer;
+	std::pmr::monotonic_buffer_resource arena;
+};
+
+
+// Rollout results by first move, for the player making it.  Win and tie
+// chances are summed over the samples: a played out sample adds 0 or 1, a
+// sample stopped at a solved board its exact chances.
+struct RolloutTotals {
+	array<double, 9> wins{};
+	array<double, 9> ties{};
+	array<uint32_t, 9> samples{};
+	
+	void add(const RolloutTotals& other) {
+		for (int pos = 0; pos < 9; pos++) {
+			wins[pos] += other.wins[pos];
+			ties[pos] += other.ties[pos];
+			samples[pos] += other.samples[pos];
+		}
+	}
+	
+	int total_samples() const {
+		int total = 0;
+		for (uint32_t n : samples) {
+			total += n;
+		}
+		return total;
+	}
+};
+
+
+static const char SHARED_CACHE_MAGIC[8] = {'T', 'T', 'T', 'S', 'H', 'M', 'C', '\0'};
+static const uint32_t SHARED_CACHE_VERSION = 2;
+
+// Chances are stored in fixed point so entries only hold integers.
+static const double SHARED_CACHE_ONE = 65536.0;
+
+struct SharedCacheEntry {
+	atomic<uint32_t> key;       // position code + 1, 0 while the slot is free
+	atomic<uint32_t> sequence;  // odd while a writer is adding to the entry
+	// Monotonic clock milliseconds when the entry's writer locked it, 0 while
+	// unlocked.  The clock is system wide, so any process can tell how long
+	// another has held the lock.
+	atomic<uint64_t> locked_at;
+	array<atomic<uint32_t>, 9> samples;
+	array<atomic<uint64_t>, 9> wins;
+	array<atomic<uint64_t>, 9> ties;
+};
+
+struct SharedCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_slots;
+	atomic<uint32_t> state;     // 0 new, 1 being set up, 2 ready
+};
+
+static_assert(atomic<uint32_t>::is_always_lock_free &&
+	atomic<uint64_t>::is_always_lock_free,
+	"Shared cache entries need address free atomics.");
+
+
+// Rollout totals by position code in a POSIX shared memory segment, so MCST
+// players in concurrent processes pool their samples.  Slots are claimed by
+// compare and swap on the key and probed linearly.  Each entry is a seqlock:
+// a writer locks the entry and makes the sequence odd while it adds its
+// totals, and a reader keeps a copy taken between two equal even sequences.
+// Nothing waits: a read or add that meets a writer is dropped.  An entry
+// locked for longer than STALE_MILLISECONDS, as when a process dies mid
+// write, is taken over by the next writer and cleared.
+class SharedPositionCache {
+public:
+	~SharedPositionCache();
+	SharedPositionCache(const SharedPositionCache&) = delete;
+	SharedPositionCache& operator=(const SharedPositionCache&) = delete;
+	
+	// Opens the segment called name, creating it if needed.  Returns null
+	// and reports to cerr if it cannot be mapped or was made by another
+	// version.
+	static shared_ptr<SharedPositionCache> open(const string& name);
+	
+	// Adds the totals cached for code, returning false if there are none
+	// or a writer is adding to them.
+	bool read(uint32_t code, RolloutTotals& totals) const;
+	
+	// Adds totals to the entry for code.  Dropped if the table is full or
+	// another writer holds the entry.
+	void add(uint32_t code, const RolloutTotals& totals);
+	
+	friend void test_shared_position_cache();
+	
+private:
+	static const int SLOT_BITS = 14;
+	static const uint32_t N_SLOTS = 1 << SLOT_BITS;
+	// Entries start on their own cache line after the header.
+	static const size_t HEADER_BYTES = 64;
+	static const int MAX_PROBES = 64;
+	// Far longer than any write takes, so only a dead writer's lock is
+	// taken over.
+	static const uint64_t STALE_MILLISECONDS = 1000;
+	// Per move cap, keeping every sum well inside its field.
+	static const uint32_t MAX_SAMPLES = 1 << 24;
+	
+	SharedPositionCache() :
+			mapping(nullptr),
+			mapping_size(0),
+			header(nullptr),
+			entries(nullptr) {}
+	
+	SharedCacheEntry* find(uint32_t code, bool claim) const;
+	
+	static uint64_t monotonic_milliseconds();
+	
+	void* mapping;
+	size_t mapping_size;
+	SharedCacheHeader* header;
+	SharedCacheEntry* entries;
+};
+
+
+// Cache named by --shared-cache, or null when there is none.
+shared_ptr<SharedPositionCache> shared_position_cache();
+
+
+const vector<ExactOutcome>& rollout_outcomes();
+
+
+class OneStepAheadMCSTPlayer : public Player {
+public:
+	// How the sample budget is spread over the root moves.  HEURISTIC lets
+	// the rollout player pick each sample's first move.  UCB gives batches
+	// of samples to the move with the highest upper confidence bound and
+	// picks the most sampled move.  HALVING samples every move evenly, drops
+	// the worse half and repeats on the rest with the same share of budget.
+	enum RootAllocation {HEURISTIC, UCB, HALVING};
+	
+	// Fewest samples worth a chunk of their own on the engine pool.
+	static const int MIN_CHUNK_SAMPLES = 250;
+	
+	OneStepAheadMCSTPlayer(
+			int p, 
+			int n = 100, 
+			double win  = 1.0, 
+			double tie  = 0.5,
+			double loss = 0.0) : 
+			player(p),
+			n_samples(n),
+			win_score(win),
+			tie_score(tie),
+			loss_score(loss),
+			n_threads(0),
+			move_time(0),
+			solve_below(0),
+			root(HEURISTIC),
+			pondering(false),
+			n_ponder_lines(0),
+			ponder_stop(false),
+			ponder_group(engine_pool()) {}
+	
+	~OneStepAheadMCSTPlayer() {
+		stop_pondering();
+	}
+	
+	// Most sample chunks run in parallel per decision, 0 for one per pool
+	// thread and the caller.
+	void set_threads(int n) {
+		n_threads = n;
+	}
+	
+	// Seconds a decision may take before sampling stops short of n_samples,
+	// 0 for no limit.
+	void set_move_time(double seconds) {
+		move_time = seconds;
+	}
+	
+	// Positions with fewer empty cells than this are valued exactly under
+	// the rollout players instead of being played out.  Root moves reaching
+	// one are not sampled at all.  0 plays every rollout to the end.
+	void set_solve_below(int empty_cells) {
+		solve_below = empty_cells;
+	}
+	
+	void set_root_allocation(RootAllocation r) {
+		root = r;
+	}
+	
+	// When on, the player keeps sampling the likely replies to its move in a
+	// task on the engine pool until its next turn, and reuses the samples of
+	// the reply actually played.  The task only runs when a pool worker is
+	// free, and is cancelled at the player's next turn.
+	void set_pondering(bool enabled) {
+		pondering = enabled;
+	}
+	
+	// Samples already in the cache for a position count towards n_samples,
+	// and the samples the player plays are added to it.
+	void set_shared_cache(shared_ptr<SharedPositionCache> c) {
+		cache = c;
+	}
+			
+	virtual Move next_move(const Board& b) {
+		MoveList moves = b.valid_moves(player);
+		DecisionArena arena;
+		
+		RolloutTotals fresh;
+		int reused_samples = 0;
+		if (pondering) {
+			reused_samples = take_pondered(b, fresh);
+		}
+		RolloutTotals cached;
+		if (cache) {
+			cache->read(b.position_code(), cached);
+		}
+		RolloutTotals known = fresh;
+		known.add(cached);
+		int remaining_samples = std::max(0,
+			n_samples - reused_samples - cached.total_samples());
+		MoveList arms;
+		if (root != HEURISTIC) {
+			for (Move m : moves) {
+				Board next_board = b;
+				next_board.apply_move(m);
+				if (solve_below == 0 || !is_solved(next_board)) {
+					arms.push_back(m);
+				}
+			}
+			if (arms.empty()) {
+				remaining_samples = 0;
+			}
+		} else if (solve_below > 0) {
+			OneStepAheadPlayer rollout_player(player);
+			if (sample_candidates(rollout_player, b).empty()) {
+				remaining_samples = 0;
+			}
+		}
+		
+		auto deadline = move_time > 0 ?
+			std::chrono::steady_clock::now() +
+				std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					std::chrono::duration<double>(move_time)) :
+			std::chrono::steady_clock::time_point::max();
+		
+		uint16_t recommended = FULL_MASK;
+		if (remaining_samples > 0 && root == UCB) {
+			recommended = allocate_ucb(
+				b, arms, remaining_samples, deadline, arena, known, fresh);
+		} else if (remaining_samples > 0 && root == HALVING) {
+			recommended = allocate_halving(
+				b, arms, remaining_samples, deadline, arena, known, fresh);
+		} else if (remaining_samples > 0) {
+			RolloutTotals sampled;
+			sample_root(b, {}, remaining_samples, deadline, arena, sampled);
+			known.add(sampled);
+			fresh.add(sampled);
+		}
+		if (cache && fresh.total_samples() > 0) {
+			cache->add(b.position_code(), fresh);
+		}
+		
+		// Pick the move with the highest summed score, or the highest mean
+		// score once cached samples or solved moves skew the sample counts.
+		array<double, 9> move_scores;
+		uint16_t considered = (cache || solve_below > 0 ?
+			mean_scores(known, move_scores) :
+			summed_scores(known, move_scores)) & recommended;
+		if (solve_below > 0) {
+			considered = solved_scores(b, considered, move_scores);
+		}
+		int max_position = moves[0].position;
+		double max_score = -std::numeric_limits<double>::infinity();
+		for (Move m : moves) {
+			if ((considered >> m.position & 1) &&
+					max_score < move_scores[m.position]) {
+				max_position = m.position;
+				max_score = move_scores[m.position];
+			}
+		}
+		
+		Move selected_move = Move(max_position, player);
+		if (verbosity > 0) {
+			print_trace(moves, move_scores, selected_move, reused_samples,
+				cached.total_samples());
+		}
+		if (pondering) {
+			start_pondering(b, selected_move);
+		}
+		
+		return selected_move;
+	}
+	
+	// Rollouts per second from the empty board, the slowest to play out,
+	// over n_chunks chunks run at once for the given seconds.
+	static double benchmark(int n_chunks, double seconds) {
+		OneStepAheadMCSTPlayer bench_player(1);
+		auto start = std::chrono::steady_clock::now();
+		auto deadline = start +
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>(seconds));
+		atomic<int> samples(0);
+		TaskGroup group(engine_pool());
+		for (int c = 0; c < n_chunks; c++) {
+			group.run([&bench_player, &samples, deadline] {
+				RolloutTotals totals;
+				samples += bench_player.simulate(Board(), 
+					std::numeric_limits<int>::max(), totals, nullptr, deadline);
+			});
+		}
+		group.wait();
+		std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - start;
+		return samples / elapsed.count();
+	}
+	
+private:
+	// Samples per UCB pull, and the smallest chunk a root move's samples
+	// are split into.
+	static constexpr int ARM_CHUNK_SAMPLES = 100;
+	static constexpr int PONDER_BATCH_SAMPLES = 100;
+	
+	// Samples gathered while pondering one reply to the player's move.
+	struct PonderLine {
+		Board board;
+		RolloutTotals totals;
+		int samples;
+	};
+	
+	int player;
+	int n_samples;
+	double win_score;
+	double tie_score;
+	double loss_score;
+	int n_threads;
+	double move_time;
+	int solve_below;
+	RootAllocation root;
+	bool pondering;
+	shared_ptr<SharedPositionCache> cache;
+	array<PonderLine, 8> ponder_lines;
+	int n_ponder_lines;
+	atomic<bool> ponder_stop;
+	TaskGroup ponder_group;
+	
+	// Plays arm_samples[pos] rollouts starting with the move at pos, and
+	// heuristic_samples with the rollout player's own first moves, in chunks
+	// run on the engine pool.  Adds the results to totals.
+	void sample_root(
+			const Board& b,
+			const array<int, 9>& arm_samples,
+			int heuristic_samples,
+			std::chrono::steady_clock::time_point deadline,
+			DecisionArena& arena,
+			RolloutTotals& totals) const {
+		WorkStealingPool& pool = engine_pool();
+		int max_chunks = n_threads > 0 ? n_threads : pool.size() + 1;
+		
+		// Jobs are numbered 0 to 8 for the root moves and 9 for the rest.
+		array<int, 10> job_samples;
+		array<int, 10> job_chunks;
+		int n_chunks = 0;
+		int most_chunks = 0;
+		for (int job = 0; job < 10; job++) {
+			job_samples[job] = job < 9 ? arm_samples[job] : heuristic_samples;
+			int min_chunk = job < 9 ? ARM_CHUNK_SAMPLES : MIN_CHUNK_SAMPLES;
+			job_chunks[job] = job_samples[job] == 0 ? 0 : std::max(1,
+				std::min(max_chunks, job_samples[job] / min_chunk));
+			n_chunks += job_chunks[job];
+			most_chunks = std::max(most_chunks, job_chunks[job]);
+		}
+		
+		// Chunks are queued round robin over the jobs so that every root move
+		// gets started before a deadline cuts sampling short.
+		std::pmr::vector<RolloutTotals> chunk_totals(
+			n_chunks, arena.resource());
+		TaskGroup group(pool);
+		int c = 0;
+		for (int j = 0; j < most_chunks; j++) {
+			for (int job = 0; job < 10; job++) {
+				if (j >= job_chunks[job]) {
+					continue;
+				}
+				MoveList first_moves;
+				if (job < 9) {
+					first_moves.push_back(Move(job, player));
+				}
+				int chunk_samples = job_samples[job] / job_chunks[job] +
+					(j < job_samples[job] % job_chunks[job] ? 1 : 0);
+				RolloutTotals& chunk = chunk_totals[c++];
+				// Seeded here so a seeded game samples the same on any thread.
+				unsigned int chunk_seed = fresh_seed();
+				group.run([this, &b, &chunk, first_moves, chunk_samples,
+						chunk_seed, deadline] {
+					SeedScope seeds(chunk_seed);
+					simulate(b, chunk_samples, chunk, nullptr, deadline,
+						first_moves.empty() ? nullptr : &first_moves);
+				});
+			}
+		}
+		group.wait();
+		
+		for (const RolloutTotals& chunk : chunk_totals) {
+			totals.add(chunk);
+		}
+	}
+	
+	// Mean score of a root move scaled to [0, 1], 0 if it has no samples.
+	double normalized_mean(const RolloutTotals& totals, int pos) const {
+		double low = std::min({win_score, tie_score, loss_score});
+		double high = std::max({win_score, tie_score, loss_score});
+		uint32_t n = totals.samples[pos];
+		if (n == 0 || high == low) {
+			return 0.0;
+		}
+		return (score(totals.wins[pos] / n, totals.ties[pos] / n) - low) /
+			(high - low);
+	}
+	
+	// Spends budget in pulls of up to ARM_CHUNK_SAMPLES, small enough for
+	// each arm to get several, a round of pulls per chunk the pool can run
+	// at once.  Within a round each pull goes to the arm with the highest
+	// UCB1 bound, counting the round's earlier pulls as samples.  Returns
+	// the most sampled arm.
+	uint16_t allocate_ucb(
+			const Board& b,
+			const MoveList& arms,
+			int budget,
+			std::chrono::steady_clock::time_point deadline,
+			DecisionArena& arena,
+			RolloutTotals& known,
+			RolloutTotals& fresh) const {
+		int max_chunks = n_threads > 0 ? n_threads : engine_pool().size() + 1;
+		int pull_samples = std::clamp(
+			budget / (4*size(arms)), 1, ARM_CHUNK_SAMPLES);
+		while (budget > 0 && std::chrono::steady_clock::now() < deadline) {
+			array<int, 9> pulls{};
+			array<double, 9> counts;
+			double total = 0;
+			for (Move m : arms) {
+				counts[m.position] = known.samples[m.position];
+				total += counts[m.position];
+			}
+			for (int c = 0; c < max_chunks && budget > 0; c++) {
+				int best = arms[0].position;
+				double best_bound = -1;
+				for (Move m : arms) {
+					double n = counts[m.position];
+					double bound = n == 0 ? std::numeric_limits<double>::infinity() :
+						normalized_mean(known, m.position) +
+							std::sqrt(2*std::log(std::max(total, 1.0)) / n);
+					if (bound > best_bound) {
+						best = m.position;
+						best_bound = bound;
+					}
+				}
+				int pull = std::min(pull_samples, budget);
+				pulls[best] += pull;
+				counts[best] += pull;
+				total += pull;
+				budget -= pull;
+			}
+			
+			RolloutTotals round;
+			sample_root(b, pulls, 0, deadline, arena, round);
+			known.add(round);
+			fresh.add(round);
+		}
+		
+		int most_sampled = arms[0].position;
+		for (Move m : arms) {
+			if (known.samples[m.position] > known.samples[most_sampled]) {
+				most_sampled = m.position;
+			}
+		}
+		return 1 << most_sampled;
+	}
+	
+	// Splits budget, and the time to the deadline, evenly over
+	// ceil(log2(arms)) rounds.  Each round samples the arms left evenly, in
+	// passes of a few chunks per arm so a round's time share ends with the
+	// arms level, then keeps the better half by mean score.  Returns the
+	// arms left.
+	uint16_t allocate_halving(
+			const Board& b,
+			const MoveList& arms,
+			int budget,
+			std::chrono::steady_clock::time_point deadline,
+			DecisionArena& arena,
+			RolloutTotals& known,
+			RolloutTotals& fresh) const {
+		array<int, 9> alive;
+		int n_alive = 0;
+		for (Move m : arms) {
+			alive[n_alive++] = m.position;
+		}
+		int n_rounds = 0;
+		while ((1 << n_rounds) < n_alive) {
+			n_rounds++;
+		}
+		
+		int max_chunks = n_threads > 0 ? n_threads : engine_pool().size() + 1;
+		n_rounds = std::max(n_rounds, 1);
+		for (int r = 0; r < n_rounds; r++) {
+			auto now = std::chrono::steady_clock::now();
+			auto round_deadline = deadline == std::chrono::steady_clock::time_point::max() ?
+				deadline : now + (deadline - now) / (n_rounds - r);
+			int per_arm = budget / (n_rounds - r) / n_alive;
+			if (per_arm == 0 || now >= deadline) {
+				break;
+			}
+			budget -= per_arm*n_alive;
+			
+			int pass_samples = std::max(ARM_CHUNK_SAMPLES,
+				ARM_CHUNK_SAMPLES*max_chunks / n_alive);
+			while (per_arm > 0 && std::chrono::steady_clock::now() < round_deadline) {
+				array<int, 9> pulls{};
+				int pass = std::min(per_arm, pass_samples);
+				for (int i = 0; i < n_alive; i++) {
+					pulls[alive[i]] = pass;
+				}
+				per_arm -= pass;
+				
+				RolloutTotals round;
+				sample_root(b, pulls, 0, round_deadline, arena, round);
+				known.add(round);
+				fresh.add(round);
+			}
+			
+			std::sort(alive.begin(), alive.begin() + n_alive, [&](int a, int c) {
+				return normalized_mean(known, a) > normalized_mean(known, c);
+			});
+			n_alive = (n_alive + 1) / 2;
+		}
+		
+		uint16_t left = 0;
+		for (int i = 0; i < n_alive; i++) {
+			left |= 1 << alive[i];
+		}
+		return left;
+	}
+	
+	// Picks the replies worth pondering after the player's move and samples
+	// them round robin in a task on the engine pool.  A reply that wins or blocks
+	// a line is what the opponent will most likely play, so when there is
+	// one only those replies are searched.
+	void start_pondering(const Board& b, Move selected_move) {
+		Board after = b;
+		after.apply_move(selected_move);
+		if (!after.is_playing()) {
+			return;
+		}
+		
+		int other = other_player(player);
+		uint16_t empty = after.empty_mask();
+		uint16_t forced = (THREAT_TABLE[after.player_mask(other)] |
+			THREAT_TABLE[after.player_mask(player)]) & empty;
+		uint16_t replies = forced ? forced : empty;
+		
+		n_ponder_lines = 0;
+		for (; replies; replies &= replies - 1) {
+			Board reply = after;
+			reply.apply_move(Move(__builtin_ctz(replies), other));
+			if (reply.is_playing()) {
+				ponder_lines[n_ponder_lines++] = {reply, {}, 0};
+			}
+		}
+		if (n_ponder_lines == 0) {
+			return;
+		}
+		
+		ponder_stop = false;
+		ponder_group.run([this] {
+			ponder();
+		});
+	}
+	
+	void ponder() {
+		for (bool active = true; active && !ponder_stop;) {
+			active = false;
+			for (int i = 0; i < n_ponder_lines && !ponder_stop; i++) {
+				PonderLine& line = ponder_lines[i];
+				if (line.samples >= n_samples) {
+					continue;
+				}
+				active = true;
+				
+				RolloutTotals batch;
+				line.samples += simulate(line.board,
+					std::min(PONDER_BATCH_SAMPLES, n_samples - line.samples),
+					batch, &ponder_stop);
+				line.totals.add(batch);
+			}
+		}
+	}
+	
+	// A ponder task still queued is run by the wait, and returns at once.
+	void stop_pondering() {
+		ponder_stop = true;
+		ponder_group.wait();
+	}
+	
+	// Stops pondering and puts the samples pondered for b in totals,
+	// returning how many there were.  Other lines are dropped.
+	int take_pondered(const Board& b, RolloutTotals& totals) {
+		stop_pondering();
+		
+		int samples = 0;
+		uint32_t code = b.position_code();
+		for (int i = 0; i < n_ponder_lines; i++) {
+			if (ponder_lines[i].board.position_code() == code) {
+				totals = ponder_lines[i].totals;
+				samples = ponder_lines[i].samples;
+				break;
+			}
+		}
+		n_ponder_lines = 0;
+		return samples;
+	}
+	
+	// Boards set up off the reachable positions have no exact value and
+	// are played out instead.
+	bool is_solved(const Board& b) const {
+		return !b.is_playing() ||
+			(__builtin_popcount(b.empty_mask()) < solve_below &&
+				b.position_rank() != NO_RANK);
+	}
+	
+	// Exact win and tie chances of a solved board for this player.
+	void solved_chances(const Board& b, double& win, double& tie) const {
+		if (!b.is_playing()) {
+			int winner = b.is_won() ? b.winning_player() : TIE;
+			win = winner == player;
+			tie = winner == TIE;
+		} else {
+			const ExactOutcome& outcome = rollout_outcomes()[b.position_rank()];
+			win = player == 1 ? outcome.win : outcome.loss;
+			tie = outcome.tie;
+		}
+	}
+	
+	double score(double win, double tie) const {
+		return win*win_score + tie*tie_score + (1.0 - win - tie)*loss_score;
+	}
+	
+	// First moves sampled with solve_below: the rollout player's choices
+	// from b, less those valued exactly.
+	MoveList sample_candidates(OneStepAheadPlayer& rollout_player, const Board& b) const {
+		MoveDistribution choices;
+		rollout_player.move_distribution(b, choices);
+		MoveList candidates;
+		for (WeightedMove choice : choices) {
+			Board next_board = b;
+			next_board.apply_move(choice.move);
+			if (!is_solved(next_board)) {
+				candidates.push_back(choice.move);
+			}
+		}
+		return candidates;
+	}
+	
+	// Score of each first move summed over its samples, which favours the
+	// moves the rollout player picks most.  Returns every move.
+	uint16_t summed_scores(
+			const RolloutTotals& totals,
+			array<double, 9>& move_scores) const {
+		for (int pos = 0; pos < 9; pos++) {
+			uint32_t n = totals.samples[pos];
+			move_scores[pos] = n == 0 ? 0.0 :
+				n*score(totals.wins[pos] / n, totals.ties[pos] / n);
+		}
+		return FULL_MASK;
+	}
+	
+	// Mean score of each sampled first move.  Returns the mask of moves
+	// sampled at least once, all moves if none were.
+	uint16_t mean_scores(
+			const RolloutTotals& totals,
+			array<double, 9>& move_scores) const {
+		uint16_t sampled = 0;
+		for (int pos = 0; pos < 9; pos++) {
+			uint32_t n = totals.samples[pos];
+			move_scores[pos] = n == 0 ? 0.0 :
+				score(totals.wins[pos] / n, totals.ties[pos] / n);
+			if (n > 0) {
+				sampled |= 1 << pos;
+			}
+		}
+		return sampled ? sampled : FULL_MASK;
+	}
+	
+	// Puts exact scores in for solved moves.  Returns the sampled mask with
+	// the solved moves added, dropping moves that were only sampled because
+	// they fell back to FULL_MASK.
+	uint16_t solved_scores(
+			const Board& b,
+			uint16_t sampled,
+			array<double, 9>& move_scores) const {
+		uint16_t considered = sampled == FULL_MASK ? 0 : sampled;
+		for (Move m : b.valid_moves(player)) {
+			Board next_board = b;
+			next_board.apply_move(m);
+			if (is_solved(next_board)) {
+				double win, tie;
+				solved_chances(next_board, win, tie);
+				move_scores[m.position] = score(win, tie);
+				considered |= 1 << m.position;
+			}
+		}
+		return considered ? considered : FULL_MASK;
+	}
+	
+	// Simulates games forward from b, putting the results by first move in
+	// totals, and returns the number of samples played before stop was set
+	// or the deadline passed.  The players and continuation game are reused for
+	// every sample.  First moves are drawn uniformly from first_moves when
+	// given, else from the sample candidates with solve_below, else made by
+	// the rollout player.  With solve_below rollouts stop at the first
+	// solved board.
+	int simulate(
+			const Board& b,
+			int n,
+			RolloutTotals& totals,
+			const atomic<bool>* stop = nullptr,
+			std::chrono::steady_clock::time_point deadline =
+				std::chrono::steady_clock::time_point::max(),
+			const MoveList* first_moves = nullptr) const {
+		static const int DEADLINE_CHECK_SAMPLES = 32;
+		bool timed = deadline != std::chrono::steady_clock::time_point::max();
+		OneStepAheadPlayer self(player);
+		OneStepAheadPlayer opponent(other_player(player));
+		Player* one = player == 1 ? &self : &opponent;
+		Player* two = player == 1 ? &opponent : &self;
+		Tictactoe continuation(one, two, b);
+		totals = RolloutTotals();
+		
+		MoveList candidates;
+		default_random_engine generator;
+		bool drawn = first_moves || solve_below > 0;
+		if (drawn) {
+			candidates = first_moves ? *first_moves : sample_candidates(self, b);
+			if (candidates.empty()) {
+				return 0;
+			}
+			generator.seed(fresh_seed());
+		}
+		uniform_int_distribution<int> candidate_dist(0, size(candidates) - 1);
+		
+		int i = 0;
+		for (; i < n && !(stop && stop->load(std::memory_order_relaxed)); i++) {
+			if (timed && i % DEADLINE_CHECK_SAMPLES == 0 &&
+					std::chrono::steady_clock::now() >= deadline) {
+				break;
+			}
+			
+			Move next_move = drawn ?
+				candidates[candidate_dist(generator)] : self.next_move(b);
+			Board next_board = b;
+			next_board.apply_move(next_move);
+			
+			if (solve_below > 0) {
+				while (!is_solved(next_board)) {
+					OneStepAheadPlayer& mover =
+						next_board.next_player() == player ? self : opponent;
+					next_board.apply_move(mover.next_move(next_board));
+				}
+				double win, tie;
+				solved_chances(next_board, win, tie);
+				totals.wins[next_move.position] += win;
+				totals.ties[next_move.position] += tie;
+				totals.samples[next_move.position]++;
+				continue;
+			}
+			
+			continuation.restart(next_board);
+			continuation.play();
+			
+			if (continuation.board.is_won()) {
+				if (continuation.board.winning_player() == player) {
+					totals.wins[next_move.position]++;
+				}
+			} else {
+				totals.ties[next_move.position]++;
+			}
+			totals.samples[next_move.position]++;
+		}
+		rollouts_played.fetch_add(i, std::memory_order_relaxed);
+		return i;
+	}
+	
+	// Written at once since games may be played in parallel.
+	void print_trace(
+			const MoveList& moves,
+			const array<double, 9>& move_scores,
+			Move selected_move,
+			int reused_samples,
+			int cached_samples) const {
+		stringstream trace;
+		if (reused_samples > 0) {
+			trace << "Pondered " << reused_samples << " samples\n";
+		}
+		if (cached_samples > 0) {
+			trace << "Cached " << cached_samples << " samples\n";
+		}
+		for (Move m : moves) {
+			trace << "Move " << static_cast<int>(m.position)
+			      << " Score " << move_scores[m.position]
+				  << "\n";
+		}
+		trace << "Selected " << selected_move << "\n";
+		cout << trace.str() << std::flush;
+	}
+};
+
+
+// Endgame database entries hold the value for the player to move in the low
+// two bits and the number of plies to the end of the game in the rest.
+static const uint8_t DB_UNREACHABLE = 0;
+static const uint8_t DB_WIN = 1;
+static const uint8_t DB_LOSS = 2;
+static const uint8_t DB_DRAW = 3;
+static const int DB_MAX_SIDE = 4;
+static const char DB_MAGIC[8] = {'T', 'T', 'T', 'E', 'G', 'D', 'B', '\0'};
+static const uint32_t DB_VERSION = 1;
+
+inline uint8_t db_entry(uint8_t value, int distance) {
+	return static_cast<uint8_t>(value | (distance << 2));
+}
+
+inline uint8_t db_value(uint8_t entry) {
+	return entry & 3;
+}
+
+inline int db_distance(uint8_t entry) {
+	return entry >> 2;
+}
+
+
+// Square board of any side, won by filling a whole row, column or diagonal.
+// Positions are indexed by their base 3 code, as in Board::position_code.
+class BoardGeometry {
+public:
+	int side;
+	int n_cells;
+	uint32_t n_codes;
+	vector<uint32_t> powers;
+	vector<vector<int>> lines;
+
+	BoardGeometry(int s);
+
+	// Returns the winning player, TIE for a full board, or PLAYING.
+	int status(const vector<int>& cells) const;
+	void decode(uint32_t code, vector<int>& cells) const;
+};
+
+
+struct EndgameDatabaseHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t side;
+	uint32_t n_entries;
+	uint32_t reserved;
+};
+
+
+// Read only view of a database file written by the build-db command.  The
+// file is memory mapped so entries are paged in on first lookup.
+class EndgameDatabase {
+public:
+	~EndgameDatabase();
+	EndgameDatabase(const EndgameDatabase&) = delete;
+	EndgameDatabase& operator=(const EndgameDatabase&) = delete;
+
+	// Returns null and reports to cerr if the file is missing or invalid.
+	static shared_ptr<const EndgameDatabase> open(const string& path);
+
+	int side() const {
+		return header->side;
+	}
+
+	uint8_t lookup(uint32_t code) const {
+		return entries[code];
+	}
+
+private:
+	EndgameDatabase() :
+			mapping(nullptr),
+			mapping_size(0),
+			header(nullptr),
+			entries(nullptr) {}
+
+	void* mapping;
+	size_t mapping_size;
+	const EndgameDatabaseHeader* header;
+	const uint8_t* entries;
+};
+
+
+class DatabasePlayer : public Player {
+public:
+	DatabasePlayer(int p, shared_ptr<const EndgameDatabase> d) :
+			player(p),
+			db(d) {}
+
+	// Prefers the fastest win, then a draw, then the slowest loss.
+	virtual Move next_move(const Board& b) {
+		uint32_t code = b.position_code();
+		MoveList moves = b.valid_moves(player);
+
+		Move best_move = moves[0];
+		int best_rank = -1;
+		for (Move m : moves) {
+			// Child entries are from the opponent's point of view.
+			uint8_t entry = db->lookup(code + player*POSITION_POWERS[m.position]);
+			int rank;
+			if (db_value(entry) == DB_LOSS) {
+				rank = 200 - db_distance(entry);
+			} else if (db_value(entry) == DB_DRAW) {
+				rank = 100;
+			} else {
+				rank = db_distance(entry);
+			}
+			if (rank > best_rank) {
+				best_rank = rank;
+				best_move = m;
+			}
+		}
+
+		return best_move;
+	}
+
+	virtual bool move_distribution(const Board& b, MoveDistribution& moves) {
+		moves.push_back({next_move(b), 1.0});
+		return true;
+	}
+
+private:
+	int player;
+	shared_ptr<const EndgameDatabase> db;
+};
+
+
+static const char LEARNED_MAGIC[8] = {'T', 'T', 'T', 'L', 'R', 'N', '\0', '\0'};
+static const uint32_t LEARNED_VERSION = 1;
+static const char DEFAULT_LEARNED_PATH[] = "tictactoe.learned";
+
+struct LearnedValuesHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_entries;
+};
+
+
+// Values learned by the learn command, indexed by position code.  Each value
+// is the expected score, win 1, tie 0.5, loss 0, for the player who made the
+// last move.  Stored as 16 bit fixed point.
+class LearnedValues {
+public:
+	LearnedValues() :
+			values(N_POSITION_CODES, 0.5f) {}
+	
+	// Returns null and reports to cerr if the file is missing or invalid.
+	static shared_ptr<const LearnedValues> load(const string& path);
+	bool save(const string& path) const;
+	
+	float value(uint32_t code) const {
+		return values[code];
+	}
+	
+	vector<float> values;
+};
+
+
+class LearnedPlayer : public Player {
+public:
+	LearnedPlayer(int p, shared_ptr<const LearnedValues> v) :
+			player(p),
+			learned(v) {}
+	
+	virtual Move next_move(const Board& b) {
+		uint32_t code = b.position_code();
+		MoveList moves = b.valid_moves(player);
+		
+		Move best_move = moves[0];
+		float best_value = -1;
+		for (Move m : moves) {
+			float v = learned->value(code + player*POSITION_POWERS[m.position]);
+			if (v > best_value) {
+				best_value = v;
+				best_move = m;
+			}
+		}
+		
+		return best_move;
+	}
+	
+	virtual bool move_distribution(const Board& b, MoveDistribution& moves) {
+		moves.push_back({next_move(b), 1.0});
+		return true;
+	}
+	
+private:
+	int player;
+	shared_ptr<const LearnedValues> learned;
+};
+
+
+// Exact outcome of a game between two players whose move distributions can
+// be listed.  The players' choices depend on the board alone, so each
+// position's outcome is worked out once and memoized by its position rank.
+class ExactScorer {
+public:
+	ExactScorer(Player* one, Player* two) :
+			players({one, two}),
+			memo(N_POSITION_RANKS),
+			solved(N_POSITION_RANKS, false),
+			n_positions(0),
+			failed_player_idx(-1) {}
+	
+	// Returns false if a player's moves can't be listed, see failed_player.
+	bool solve(Board b, ExactOutcome& outcome) {
+		if (!b.is_playing()) {
+			int winner = b.is_won() ? b.winning_player() : TIE;
+			outcome = ExactOutcome();
+			outcome.win = winner == 1;
+			outcome.loss = winner == 2;
+			outcome.tie = winner == TIE;
+			return true;
+		}
+		
+		uint16_t rank = b.position_rank();
+		if (rank != NO_RANK && solved[rank]) {
+			outcome = memo[rank];
+			return true;
+		}
+		
+		int player_idx = b.next_player_idx();
+		MoveDistribution moves;
+		if (!players[player_idx]->move_distribution(b, moves)) {
+			failed_player_idx = player_idx;
+			return false;
+		}
+		
+		outcome = ExactOutcome();
+		for (WeightedMove wm : moves) {
+			Board next_board = b;
+			next_board.apply_move(wm.move);
+			ExactOutcome next;
+			if (!solve(next_board, next)) {
+				return false;
+			}
+			outcome.win += wm.probability*next.win;
+			outcome.loss += wm.probability*next.loss;
+			outcome.tie += wm.probability*next.tie;
+			outcome.moves += wm.probability*(1 + next.moves);
+		}
+		
+		if (rank != NO_RANK) {
+			memo[rank] = outcome;
+			solved[rank] = true;
+		}
+		n_positions++;
+		return true;
+	}
+	
+	int positions() const {
+		return n_positions;
+	}
+	
+	// Index of the player whose moves could not be listed, or -1.
+	int failed_player() const {
+		return failed_player_idx;
+	}
+	
+private:
+	array<Player*, 2> players;
+	vector<ExactOutcome> memo;
+	vector<bool> solved;
+	int n_positions;
+	int failed_player_idx;
+};
+
+
+// Self-play trainer for LearnedValues.  Threads share one table and update it
+// without locks, Hogwild style, so an update may occasionally be lost to a
+// concurrent write of the same entry.
+class SelfPlayTrainer {
+public:
+	SelfPlayTrainer(double a = 0.1, double e = 0.1) :
+			alpha(a),
+			epsilon(e),
+			values(new atomic<float>[N_POSITION_CODES]) {
+		for (uint32_t i = 0; i < N_POSITION_CODES; i++) {
+			values[i].store(0.5f, std::memory_order_relaxed);
+		}
+	}
+	
+	// Plays n_games epsilon greedy games, updating values after each one.
+	void train(int n_games, unsigned int seed);
+	
+	LearnedValues snapshot() const;
+	
+private:
+	double alpha;
+	double epsilon;
+	unique_ptr<atomic<float>[]> values;
+};
+
+
+// Moves for the board variants, positions may go past 9.
+class VariantMove {
+public:
+	uint8_t position;
+	uint8_t player;
+	
+	VariantMove() :
+			position(0),
+			player(0) {}
+	
+	VariantMove(int pos, int p) :
+			position(pos),
+			player(p) {}
+			
+	friend ostream& operator<<(ostream& os, const VariantMove& m);
+};
+
+
+// Ultimate tic-tac-toe: nine 3x3 sub-boards, position 9*sub + cell.  The cell
+// played picks the sub-board the opponent must play in, unless it is already
+// decided.  Each player's marks are a 9 bit mask per sub-board and won and
+// decided sub-boards are cached as masks, so move generation and win checks
+// are table lookups.
+class UltimateBoard {
+public:
+	typedef VariantMove move_type;
+	static const int max_moves = 81;
+	
+	UltimateBoard() :
+			cells{},
+			won{},
+			closed(0),
+			forced(-1),
+			status(PLAYING),
+			m_next_player(1) {}
+	
+	friend ostream& operator<<(ostream& os, const UltimateBoard& b);
+	
+	bool is_won() const {
+		return status > 0;
+	}
+	
+	bool is_tie() const {
+		return status == TIE;
+	}
+	
+	bool is_playing() const {
+		return status == PLAYING;
+	}
+	
+	// Valid return only if UltimateBoard::is_won returns true.
+	int winning_player() const {
+		return status;
+	}
+	
+	void apply_move(VariantMove m) {
+		int sub = m.position / 9;
+		int cell = m.position % 9;
+		int idx = m.player - 1;
+		uint16_t sub_bit = 1 << sub;
+		
+		cells[idx][sub] |= 1 << cell;
+		if (LINE_TABLE[cells[idx][sub]]) {
+			won[idx] |= sub_bit;
+			closed |= sub_bit;
+			if (LINE_TABLE[won[idx]]) {
+				status = m.player;
+			}
+		} else if ((cells[0][sub] | cells[1][sub]) == FULL_MASK) {
+			closed |= sub_bit;
+		}
+		if (status == PLAYING && closed == FULL_MASK) {
+			status = TIE;
+		}
+		
+		forced = (closed >> cell) & 1 ? -1 : cell;
+		m_next_player = other_player(m_next_player);
+	}
+	
+	vector<VariantMove> valid_moves(int player) const {
+		vector<VariantMove> moves;
+		
+		unsigned subs = forced >= 0 ? 1u << forced : FULL_MASK & ~closed;
+		for (; subs; subs &= subs - 1) {
+			int sub = __builtin_ctz(subs);
+			unsigned empty = FULL_MASK & ~(cells[0][sub] | cells[1][sub]);
+			for (; empty; empty &= empty - 1) {
+				moves.push_back(VariantMove(9*sub + __builtin_ctz(empty), player));
+			}
+		}
+		
+		return moves;
+	}
+	
+	int next_player() const {
+		return m_next_player;
+	}
+	
+	// Player owning a position, or EMPTY.
+	int cell(int position) const {
+		int sub = position / 9;
+		int bit = 1 << (position % 9);
+		return (cells[0][sub] & bit) ? 1 : (cells[1][sub] & bit) ? 2 : EMPTY;
+	}
+	
+	// Sub-board the next move must be played in, -1 for any open sub-board.
+	int forced_sub_board() const {
+		return forced;
+	}
+	
+private:
+	array<array<uint16_t, 9>, 2> cells;
+	array<uint16_t, 2> won;
+	uint16_t closed;
+	int forced;
+	int status;
+	int m_next_player;
+};
+
+
+// The 76 winning lines of the 4x4x4 cube as 64 bit masks, position
+// 16*layer + 4*row + column.  Each position also lists the lines through it
+// so a move only tests the 4 or 7 lines it can complete.
+class QubicLines {
+public:
+	vector<uint64_t> lines;
+	array<vector<uint64_t>, 64> lines_through;
+	
+	QubicLines() {
+		for (int dz = -1; dz <= 1; dz++) {
+			for (int dy = -1; dy <= 1; dy++) {
+				for (int dx = -1; dx <= 1; dx++) {
+					// Use one of each pair of opposite directions.
+					int d = 9*dz + 3*dy + dx;
+					if (d <= 0) {
+						continue;
+					}
+					add_lines(dx, dy, dz);
+				}
+			}
+		}
+	}
+	
+private:
+	static bool inside(int x, int y, int z) {
+		return x >= 0 && x < 4 && y >= 0 && y < 4 && z >= 0 && z < 4;
+	}
+	
+	void add_lines(int dx, int dy, int dz) {
+		for (int z = 0; z < 4; z++) {
+			for (int y = 0; y < 4; y++) {
+				for (int x = 0; x < 4; x++) {
+					if (inside(x - dx, y - dy, z - dz) ||
+							!inside(x + 3*dx, y + 3*dy, z + 3*dz)) {
+						continue;
+					}
+					uint64_t line = 0;
+					for (int i = 0; i < 4; i++) {
+						line |= uint64_t(1) <<
+							(16*(z + i*dz) + 4*(y + i*dy) + x + i*dx);
+					}
+					lines.push_back(line);
+					for (uint64_t bits = line; bits; bits &= bits - 1) {
+						lines_through[__builtin_ctzll(bits)].push_back(line);
+					}
+				}
+			}
+		}
+	}
+};
+
+static const QubicLines QUBIC_LINES;
+
+
+// 3D 4x4x4 tic-tac-toe, each player's cells are one 64 bit mask.
+class QubicBoard {
+public:
+	typedef VariantMove move_type;
+	static const int max_moves = 64;
+	
+	QubicBoard() :
+			cells{},
+			threats{},
+			status(PLAYING),
+			m_next_player(1) {}
+	
+	friend ostream& operator<<(ostream& os, const QubicBoard& b);
+	
+	bool is_won() const {
+		return status > 0;
+	}
+	
+	bool is_tie() const {
+		return status == TIE;
+	}
+	
+	bool is_playing() const {
+		return status == PLAYING;
+	}
+	
+	// Valid return only if QubicBoard::is_won returns true.
+	int winning_player() const {
+		return status;
+	}
+	
+	void apply_move(VariantMove m) {
+		uint64_t& mine = cells[m.player - 1];
+		uint64_t theirs = cells[other_player(m.player) - 1];
+		mine |= uint64_t(1) << m.position;
+		for (uint64_t line : QUBIC_LINES.lines_through[m.position]) {
+			if ((mine & line) == line) {
+				status = m.player;
+			} else if (__builtin_popcountll(mine & line) == 3 && !(theirs & line)) {
+				threats[m.player - 1] |= line & ~mine;
+			}
+		}
+		if (status == PLAYING && (cells[0] | cells[1]) == ~uint64_t(0)) {
+			status = TIE;
+		}
+		m_next_player = other_player(m_next_player);
+	}
+	
+	vector<VariantMove> valid_moves(int player) const {
+		vector<VariantMove> moves;
+		
+		for (uint64_t empty = ~(cells[0] | cells[1]); empty; empty &= empty - 1) {
+			moves.push_back(VariantMove(__builtin_ctzll(empty), player));
+		}
+		
+		return moves;
+	}
+	
+	int next_player() const {
+		return m_next_player;
+	}
+	
+	// Player owning a position, or EMPTY.
+	int cell(int position) const {
+		uint64_t bit = uint64_t(1) << position;
+		return (cells[0] & bit) ? 1 : (cells[1] & bit) ? 2 : EMPTY;
+	}
+	
+	// Positions that complete a line for player.
+	uint64_t winning_cells(int player) const {
+		return threats[player - 1] & ~(cells[0] | cells[1]);
+	}
+	
+private:
+	array<uint64_t, 2> cells;
+	// Cells that ever completed a third mark on an open line, kept as moves
+	// are applied.  A line stays open until its last cell is taken, so
+	// masking out taken cells leaves the live threats.
+	array<uint64_t, 2> threats;
+	int status;
+	int m_next_player;
+};
+
+
+// Player interface for the board variants.  Board types provide the same
+// members as Board plus a move_type.
+template <typename B>
+class VariantPlayer {
+public:
+	typedef typename B::move_type move_type;
+	
+	virtual ~VariantPlayer() {};
+	virtual move_type next_move(const B&) = 0;
+};
+
+
+template <typename B>
+class VariantGame {
+public:
+	typedef typename B::move_type move_type;
+	
+	MoveRecord<move_type, B::max_moves> action_log;
+	B board;
+	MoveObserver* observer;
+	
+	VariantGame(VariantPlayer<B>* p1, VariantPlayer<B>* p2) :
+			observer(nullptr),
+			players({p1, p2}),
+			next_player_idx(0) {}
+			
+	VariantGame(VariantPlayer<B>* p1, VariantPlayer<B>* p2, B initial) :
+			board(initial),
+			observer(nullptr),
+			players({p1, p2}),
+			next_player_idx(board.next_player() - 1) {}
+	
+	void play() {
+		for (;
+				board.is_playing();
+				next_player_idx = other_player_index(next_player_idx)) {
+			if (observer) {
+				observer->before_move(action_log.size(), next_player_idx);
+			}
+			move_type m = players[next_player_idx]->next_move(board);
+			if (observer) {
+				observer->after_move(action_log.size(), next_player_idx);
+			}
+			board.apply_move(m);
+			action_log.push_back(m);
+		}
+	}
+	
+private:
+	array<VariantPlayer<B>*, 2> players;
+	int next_player_idx;
+};
+
+
+template <typename B>
+class VariantRandomPlayer : public VariantPlayer<B> {
+public:
+	typedef typename B::move_type move_type;
+	
+	VariantRandomPlayer(int p) :
+			player(p),
+			generator(fresh_seed()) {}
+	
+	VariantRandomPlayer(int p, unsigned int seed) :
+			player(p),
+			generator(seed) {}
+	
+	virtual move_type next_move(const B& b) {
+		vector<move_type> moves = b.valid_moves(player);
+		uniform_int_distribution<int> idx_dist(0, size(moves) - 1);
+		return moves[idx_dist(generator)];
+	}
+	
+private:
+	int player;
+	default_random_engine generator;
+};
+
+
+template <typename B>
+class VariantOneStepAheadPlayer : public VariantPlayer<B> {
+public:
+	typedef typename B::move_type move_type;
+	
+	VariantOneStepAheadPlayer(int p) :
+			player(p),
+			random_alternative(player) {}
+	
+	virtual move_type next_move(const B& b) {
+		vector<move_type> moves = b.valid_moves(player);
+		
+		// Look for winning moves.
+		for (move_type m : moves) {
+			B next_board = b;
+			next_board.apply_move(m);
+			if (next_board.is_won()) {
+				return m;
+			}
+		}
+		
+		// Look for blocking moves.
+		int other = other_player(player);
+		for (move_type m : moves) {
+			B next_board = b;
+			next_board.apply_move(move_type(m.position, other));
+			if (next_board.is_won()) {
+				return m;
+			}
+		}
+		
+		// Default to a random move.
+		return random_alternative.next_move(b);
+	}
+	
+private:
+	int player;
+	VariantRandomPlayer<B> random_alternative;
+};
+
+
+// Qubic finds wins and blocks from its line counts instead of trying moves.
+template <>
+inline VariantMove VariantOneStepAheadPlayer<QubicBoard>::next_move(
+		const QubicBoard& b) {
+	uint64_t wins = b.winning_cells(player);
+	if (wins) {
+		return VariantMove(__builtin_ctzll(wins), player);
+	}
+	uint64_t blocks = b.winning_cells(other_player(player));
+	if (blocks) {
+		return VariantMove(__builtin_ctzll(blocks), player);
+	}
+	return random_alternative.next_move(b);
+}
+
+
+// Same sampling as OneStepAheadMCSTPlayer, with the heuristic player making
+// both sides' moves in the continuations.
+template <typename B>
+class VariantMCSTPlayer : public VariantPlayer<B> {
+public:
+	typedef typename B::move_type move_type;
+	
+	VariantMCSTPlayer(
+			int p,
+			int n = 100,
+			double win  = 1.0,
+			double tie  = 0.5,
+			double loss = 0.0) :
+			player(p),
+			n_samples(n),
+			win_score(win),
+			tie_score(tie),
+			loss_score(loss),
+			self(player),
+			opponent(other_player(player)) {}
+	
+	virtual move_type next_move(const B& b) {
+		vector<move_type> moves = b.valid_moves(player);
+		array<double, B::max_moves> move_scores{};
+		
+		for (int i = 0; i < n_samples; i++) {
+			move_type next_move = self.next_move(b);
+			B next_board = b;
+			next_board.apply_move(next_move);
+			
+			VariantPlayer<B>* one = player == 1 ? &self : &opponent;
+			VariantPlayer<B>* two = player == 1 ? &opponent : &self;
+			VariantGame<B> continuation(one, two, next_board);
+			continuation.play();
+			
+			if (continuation.board.is_won()) {
+				if (continuation.board.winning_player() == player) {
+					move_scores[next_move.position] += win_score;
+				} else {
+					move_scores[next_move.position] += loss_score;
+				}
+			} else {
+				move_scores[next_move.position] += tie_score;
+			}
+		}
+		rollouts_played.fetch_add(n_samples, std::memory_order_relaxed);
+		
+		int max_position = moves[0].position;
+		double max_score = move_scores[max_position];
+		for (move_type m : moves) {
+			if (max_score < move_scores[m.position]) {
+				max_position = m.position;
+				max_score = move_scores[m.position];
+			}
+		}
+		
+		return move_type(max_position, player);
+	}
+	
+private:
+	int player;
+	int n_samples;
+	double win_score;
+	double tie_score;
+	double loss_score;
+	VariantOneStepAheadPlayer<B> self;
+	VariantOneStepAheadPlayer<B> opponent;
+};
+
+
+// Rollouts are far longer on the variant boards, so MCST samples less.
+static const int VARIANT_MCST_SAMPLES = 1000;
+
+
+// A player name with optional settings, as given on the command line:
+// "one_step_ahead_mcst:samples=2000,threads=8,move_time=10ms".  Settings
+// left at 0 keep the player's defaults.
+static const int AUTO_SAMPLES = -1;
+static const double DEFAULT_LATENCY_SECONDS = 0.05;
+
+struct PlayerSpec {
+	string text;
+	string name;
+	// AUTO_SAMPLES when samples and threads come from the host calibration
+	// and the latency target.
+	int samples = 0;
+	int threads = 0;
+	double move_time = 0;
+	double latency = 0;
+	int solve_below = 0;
+	OneStepAheadMCSTPlayer::RootAllocation root = OneStepAheadMCSTPlayer::HEURISTIC;
+	bool ponder = false;
+	
+	// Reports to cerr and returns false for unknown keys or bad values.
+	// Whether the name is a player is left to the caller.
+	bool parse(const string& spec_text);
+};
+
+template <typename B>
+VariantPlayer<B>* find_variant_player_by_name(const PlayerSpec& spec, int player) {
+	if (spec.name == "random") {
+		return new VariantRandomPlayer<B>(player);
+	} else if (spec.name == "one_step_ahead") {
+		return new VariantOneStepAheadPlayer<B>(player);
+	} else if (spec.name == "one_step_ahead_mcst") {
+		return new VariantMCSTPlayer<B>(player,
+			spec.samples > 0 ? spec.samples : VARIANT_MCST_SAMPLES);
+	} else {
+		return 0; // If valid player not found.
+	}
+}
+
+
+// Player and game types used to score games on a board type.
+template <typename B>
+struct GameTraits {
+	typedef VariantPlayer<B> player_type;
+	typedef VariantGame<B> game_type;
+	
+	static player_type* find_player(const PlayerSpec& spec, int player) {
+		return find_variant_player_by_name<B>(spec, player);
+	}
+};
+
+Player* find_player_by_name(const PlayerSpec& spec, int player);
+
+template <>
+struct GameTraits<Board> {
+	typedef Player player_type;
+	typedef Tictactoe game_type;
+	
+	static player_type* find_player(const PlayerSpec& spec, int player) {
+		return find_player_by_name(spec, player);
+	}
+};
+
+
+// When a score run may stop before n_games.  SPRT tests H0: player one's
+// mean score is s0 against H1: it is s1, with error rates alpha and beta.
+// MARGIN stops once the 95% confidence interval of the mean score is
+// within +/- margin.
+struct StoppingRule {
+	enum Kind {NONE, SPRT, MARGIN};
+	
+	Kind kind = NONE;
+	double s0 = 0;
+	double s1 = 0;
+	double alpha = 0.05;
+	double beta = 0.05;
+	double margin = 0;
+};
+
+
+// Game i of a sharded run belongs to shard i % n_shards.  Without --seed a
+// run seed is drawn, and is kept by checkpoints for resuming.
+struct ScoreOptions {
+	string variant = "standard";
+	bool print_games = true;
+	bool report_timing = false;
+	bool track_allocations = false;
+	double progress_interval = 0;
+	StoppingRule stopping;
+	bool seeded = false;
+	uint64_t seed = 0;
+	int shard_index = 0;
+	int n_shards = 1;
+	string checkpoint_path;
+	bool resume = false;
+	bool latency_per_ply = false;
+};
+
+
+static const char DEFAULT_CALIBRATION_PATH[] = "tictactoe.calibration";
+
+// Rollout throughput of a host, measured once and kept in a small file so
+// later runs skip the benchmark.  The file is redone when read on a host
+// with another name or core count.
+struct HostCalibration {
+	string host;
+	int n_cpus = 0;
+	double single_rate = 0;     // rollouts/s on one thread
+	double parallel_rate = 0;   // rollouts/s on every pool thread and the caller
+	
+	// This host's name and core count, with no rates.
+	static HostCalibration current_host();
+	
+	// Runs the rollout benchmark on this host.
+	static HostCalibration measure();
+	
+	bool write(const string& path) const;
+	
+	// Returns false if the file is missing or invalid, without reporting.
+	bool read(const string& path);
+	
+	bool same_host(const HostCalibration& other) const {
+		return host == other.host && n_cpus == other.n_cpus;
+	}
+	
+	// MCST samples and threads whose decisions should take about latency
+	// seconds, for at most max_threads threads.  Threads are dropped while
+	// there are too few samples to give each a chunk, as the pool would not
+	// use them.
+	void budget(double latency, int max_threads, int& samples, int& threads) const;
+};
+
+
+// Calibration of this host, read from the file named by
+// TICTACTOE_CALIBRATION or tictactoe.calibration, measured and written
+// there on first use if it is missing or from another host.
+const HostCalibration& host_calibration();
+
+// Gets the calibration up front when either player takes its budget from
+// it, so the benchmark has the machine to itself before games start.
+void calibrate_players(const PlayerSpec& player_one, const PlayerSpec& player_two);
+
+
+// Where a score run, or one shard of it, has got to.  Games are counted in
+// shard order, so the completed games are always the first next_game of
+// the shard, and their seeds follow from the run seed.
+struct ScoreCheckpoint {
+	string player_one_name;
+	string player_two_name;
+	string variant;
+	int n_games = 0;
+	uint64_t seed = 0;
+	int shard_index = 0;
+	int n_shards = 1;
+	int next_game = 0;
+	int wins = 0;
+	int losses = 0;
+	int ties = 0;
+	uint64_t moves = 0;
+	
+	// Written to a temporary file first so a kill never leaves half a file.
+	bool write(const string& path) const;
+	
+	// Reports to cerr and returns false if the file is missing or invalid.
+	bool read(const string& path);
+	
+	bool same_run(const ScoreCheckpoint& other) const {
+		return player_one_name == other.player_one_name &&
+			player_two_name == other.player_two_name &&
+			variant == other.variant &&
+			n_games == other.n_games &&
+			seed == other.seed &&
+			n_shards == other.n_shards;
+	}
+	
+	int shard_games() const {
+		return (n_games - shard_index + n_shards - 1) / n_shards;
+	}
+	
+	int played() const {
+		return wins + losses + ties;
+	}
+};
+
+
+// Applies a StoppingRule to games scored 1, 0.5 or 0 for player one.  The
+// SPRT log likelihood ratio uses the normal approximation with the sample
+// variance, as engine testing frameworks do.
+class SequentialTest {
+public:
+	explicit SequentialTest(const StoppingRule& r) :
+			rule(r),
+			n_games(0),
+			sum(0),
+			sum_squares(0) {}
+	
+	void add(double score, int count = 1) {
+		n_games += count;
+		sum += score*count;
+		sum_squares += score*score*count;
+	}
+	
+	bool conclusive() const {
+		if (rule.kind == StoppingRule::NONE || n_games < MIN_GAMES) {
+			return false;
+		} else if (rule.kind == StoppingRule::SPRT) {
+			return llr() <= lower_bound() || llr() >= upper_bound();
+		} else {
+			return half_width() <= rule.margin;
+		}
+	}
+	
+	void print_result(ostream& os) const;
+	
+	// Too few games give a variance estimate the test can't rely on.
+	static const int MIN_GAMES = 20;
+	
+	double mean() const {
+		return sum / n_games;
+	}
+	
+	double variance() const {
+		return std::max(sum_squares / n_games - mean()*mean(), 1e-4);
+	}
+	
+	double llr() const {
+		return (rule.s1 - rule.s0) *
+			(sum - n_games*(rule.s0 + rule.s1)/2) / variance();
+	}
+	
+	double lower_bound() const {
+		return std::log(rule.beta / (1 - rule.alpha));
+	}
+	
+	double upper_bound() const {
+		return std::log((1 - rule.beta) / rule.alpha);
+	}
+	
+	double half_width() const {
+		return 1.96 * std::sqrt(variance() / n_games);
+	}
+	
+private:
+	StoppingRule rule;
+	int n_games;
+	double sum;
+	double sum_squares;
+};
+
+
+// Allocation totals over a set of samples, games or move decisions.
+struct AllocationTotals {
+	uint64_t samples = 0;
+	uint64_t count = 0;
+	uint64_t bytes = 0;
+	uint64_t max_count = 0;
+	uint64_t max_bytes = 0;
+	
+	void add(uint64_t c, uint64_t b) {
+		samples++;
+		count += c;
+		bytes += b;
+		max_count = std::max(max_count, c);
+		max_bytes = std::max(max_bytes, b);
+	}
+	
+	void merge(const AllocationTotals& other) {
+		samples += other.samples;
+		count += other.count;
+		bytes += other.bytes;
+		max_count = std::max(max_count, other.max_count);
+		max_bytes = std::max(max_bytes, other.max_bytes);
+	}
+};
+
+
+// Counts of nanosecond durations in log-spaced buckets, 16 per power of two,
+// so any percentile is within about 6% at a fixed small size.
+class LatencyHistogram {
+public:
+	LatencyHistogram() :
+			buckets{},
+			n_samples(0),
+			max_value(0) {}
+	
+	void add(uint64_t nanoseconds) {
+		buckets[bucket_index(nanoseconds)]++;
+		n_samples++;
+		max_value = std::max(max_value, nanoseconds);
+	}
+	
+	uint64_t samples() const {
+		return n_samples;
+	}
+	
+	uint64_t max() const {
+		return max_value;
+	}
+	
+	// Upper end of the bucket holding the q-th quantile, capped at max.
+	uint64_t percentile(double q) const {
+		uint64_t rank = std::max<uint64_t>(1, std::ceil(q*n_samples));
+		uint64_t seen = 0;
+		for (int i = 0; i < N_BUCKETS; i++) {
+			seen += buckets[i];
+			if (seen >= rank) {
+				return std::min(bucket_limit(i), max_value);
+			}
+		}
+		return max_value;
+	}
+	
+private:
+	static const int SUB_BUCKET_BITS = 4;
+	static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+	static const int N_BUCKETS = (64 - SUB_BUCKET_BITS + 1)*SUB_BUCKETS;
+	
+	array<uint64_t, N_BUCKETS> buckets;
+	uint64_t n_samples;
+	uint64_t max_value;
+	
+	static int bucket_index(uint64_t v) {
+		if (v < SUB_BUCKETS) {
+			return v;
+		}
+		int shift = 63 - __builtin_clzll(v) - SUB_BUCKET_BITS;
+		return (shift + 1)*SUB_BUCKETS + ((v >> shift) & (SUB_BUCKETS - 1));
+	}
+	
+	static uint64_t bucket_limit(int index) {
+		if (index < SUB_BUCKETS) {
+			return index;
+		}
+		int shift = index / SUB_BUCKETS - 1;
+		uint64_t low = static_cast<uint64_t>(
+			SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+		return low + (uint64_t(1) << shift) - 1;
+	}
+};
+
+
+// Collects metrics for one game while it is played.
+class GameMetrics : public MoveObserver {
+public:
+	// Enough plies for every board, up to ultimate's 81 cells.
+	static const int MAX_PLIES = 81;
+	
+	AllocationCounter game_allocations;
+	array<AllocationTotals, 2> move_allocations;
+	array<uint64_t, MAX_PLIES> move_nanoseconds;
+	int n_moves = 0;
+	
+	virtual void before_move(int, int) {
+		if (alloc_tracking_enabled) {
+			move_counter.reset();
+			move_counter.parent = current_allocation_counter;
+			current_allocation_counter = &move_counter;
+		}
+		move_start = std::chrono::steady_clock::now();
+	}
+	
+	virtual void after_move(int ply, int player_idx) {
+		auto move_end = std::chrono::steady_clock::now();
+		if (ply < MAX_PLIES) {
+			move_nanoseconds[ply] = std::chrono::duration_cast<
+				std::chrono::nanoseconds>(move_end - move_start).count();
+			n_moves = ply + 1;
+		}
+		if (alloc_tracking_enabled) {
+			current_allocation_counter = move_counter.parent;
+			move_allocations[player_idx].add(
+				move_counter.count, move_counter.bytes);
+		}
+	}
+	
+private:
+	AllocationCounter move_counter;
+	std::chrono::steady_clock::time_point move_start;
+};
+
+
+// Metrics over every game of a score or bench run.  Player one moves on
+// even plies and player two on odd ones.
+class ScoreMetrics {
+public:
+	explicit ScoreMetrics(bool per_ply) :
+			ply_latencies(per_ply ? GameMetrics::MAX_PLIES : 0) {}
+	
+	void add_game(const GameMetrics& game) {
+		std::lock_guard<std::mutex> lock(mutex);
+		game_allocations.add(
+			game.game_allocations.count, game.game_allocations.bytes);
+		for (int idx = 0; idx < 2; idx++) {
+			move_allocations[idx].merge(game.move_allocations[idx]);
+		}
+		for (int ply = 0; ply < game.n_moves; ply++) {
+			player_latencies[ply % 2].add(game.move_nanoseconds[ply]);
+			if (!ply_latencies.empty()) {
+				ply_latencies[ply].add(game.move_nanoseconds[ply]);
+			}
+		}
+	}
+	
+	void print_allocations(
+			ostream& os,
+			const string& player_one_name,
+			const string& player_two_name) const;
+	
+	void print_latencies(
+			ostream& os,
+			const string& player_one_name,
+			const string& player_two_name) const;
+	
+private:
+	std::mutex mutex;
+	AllocationTotals game_allocations;
+	array<AllocationTotals, 2> move_allocations;
+	array<LatencyHistogram, 2> player_latencies;
+	vector<LatencyHistogram> ply_latencies;
+};
+
+
+// Prints games and rollouts per second, games completed and the time left
+// to cerr every interval seconds from a thread of its own, which only reads
+// the atomic counters the games bump.
+class ProgressReporter {
+public:
+	ProgressReporter(int total, double interval) :
+			n_total(total),
+			n_finished(0),
+			start(std::chrono::steady_clock::now()),
+			start_rollouts(rollouts_played.load()),
+			stopped(false) {
+		if (interval > 0) {
+			reporter = thread([this, interval] {
+				report_periodically(interval);
+			});
+		}
+	}
+	
+	~ProgressReporter() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopped = true;
+		}
+		wake.notify_one();
+		if (reporter.joinable()) {
+			reporter.join();
+		}
+	}
+	
+	void game_finished() {
+		n_finished.fetch_add(1, std::memory_order_relaxed);
+	}
+	
+	uint64_t rollouts() const {
+		return rollouts_played.load() - start_rollouts;
+	}
+	
+private:
+	int n_total;
+	atomic<int> n_finished;
+	std::chrono::steady_clock::time_point start;
+	uint64_t start_rollouts;
+	bool stopped;
+	std::mutex mutex;
+	std::condition_variable wake;
+	thread reporter;
+	
+	void report_periodically(double interval) {
+		auto period = std::chrono::duration<double>(interval);
+		auto last_time = start;
+		int last_games = 0;
+		uint64_t last_rollouts = 0;
+		
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!wake.wait_for(lock, period, [this] { return stopped; })) {
+			auto now = std::chrono::steady_clock::now();
+			int games = n_finished.load(std::memory_order_relaxed);
+			uint64_t n_rollouts = rollouts();
+			double since_last =
+				std::chrono::duration<double>(now - last_time).count();
+			double since_start =
+				std::chrono::duration<double>(now - start).count();
+			
+			cerr << "Progress " << games << "/" << n_total << " games, "
+			     << (games - last_games) / since_last << " games/s, "
+				 << (n_rollouts - last_rollouts) / since_last << " rollouts/s";
+			if (games > 0) {
+				cerr << ", ETA " << static_cast<int>(
+					since_start * (n_total - games) / games) << " s";
+			}
+			cerr << endl;
+			
+			last_time = now;
+			last_games = games;
+			last_rollouts = n_rollouts;
+		}
+	}
+};
+
+
+
+// Aggregates over game logs as score prints them, "1@4 2@0 ... W", with
+// the result from player one's perspective.  Positions up to the ultimate
+// board's 81 cells are accepted so every variant's logs can be read.
+class GameLogStats {
+public:
+	static const int MAX_POSITIONS = 81;
+	
+	GameLogStats() :
+			n_games(0),
+			n_skipped(0),
+			results{},
+			first_move_results{},
+			openings(MAX_POSITIONS*MAX_POSITIONS),
+			lengths{} {}
+	
+	// Parses every newline terminated or final line of text.  Lines that
+	// are not game logs, such as score's summary, are counted as skipped.
+	void add_text(string_view text) {
+		while (!text.empty()) {
+			size_t end = text.find('\n');
+			add_line(text.substr(0, end));
+			text.remove_prefix(end == string_view::npos ? text.size() : end + 1);
+		}
+	}
+	
+	void merge(const GameLogStats& other);
+	void print(ostream& os) const;
+	
+	uint64_t games() const {
+		return n_games;
+	}
+	
+	uint64_t skipped() const {
+		return n_skipped;
+	}
+	
+private:
+	// Results indexed win, loss, tie.
+	typedef array<uint64_t, 3> ResultCounts;
+	
+	uint64_t n_games;
+	uint64_t n_skipped;
+	ResultCounts results;
+	array<ResultCounts, MAX_POSITIONS> first_move_results;
+	vector<uint64_t> openings;
+	array<uint64_t, MAX_POSITIONS + 1> lengths;
+	
+	void add_line(string_view line) {
+		if (!line.empty() && line.back() == '\r') {
+			line.remove_suffix(1);
+		}
+		if (line.size() < 2 || line[line.size() - 2] != ' ') {
+			n_skipped += !line.empty();
+			return;
+		}
+		
+		int result;
+		switch (line.back()) {
+			case 'W': result = 0; break;
+			case 'L': result = 1; break;
+			case 'T': result = 2; break;
+			default: n_skipped++; return;
+		}
+		
+		int n_moves = 0;
+		int first = 0;
+		int second = -1;
+		size_t i = 0;
+		size_t end = line.size() - 2;
+		while (i < end) {
+			if (line[i] == ' ') {
+				i++;
+				continue;
+			}
+			if ((line[i] != '1' && line[i] != '2') ||
+					i + 2 >= line.size() || line[i + 1] != '@') {
+				n_skipped++;
+				return;
+			}
+			i += 2;
+			
+			int position = 0;
+			size_t digits = i;
+			for (; i < end && line[i] >= '0' && line[i] <= '9'; i++) {
+				position = position*10 + (line[i] - '0');
+			}
+			if (i == digits || position >= MAX_POSITIONS ||
+					n_moves == MAX_POSITIONS) {
+				n_skipped++;
+				return;
+			}
+			
+			if (n_moves == 0) {
+				first = position;
+			} else if (n_moves == 1) {
+				second = position;
+			}
+			n_moves++;
+		}
+		if (n_moves == 0) {
+			n_skipped++;
+			return;
+		}
+		
+		n_games++;
+		results[result]++;
+		first_move_results[first][result]++;
+		if (second >= 0) {
+			openings[first*MAX_POSITIONS + second]++;
+		}
+		lengths[n_moves]++;
+	}
+};
+
+
+// Return object of a session's game coroutine.  It starts at once and stays
+// suspended at the end so the host can tell it is done and free it.
+struct SessionTask {
+	struct promise_type {
+		SessionTask get_return_object() {
+			return {std::coroutine_handle<promise_type>::from_promise(*this)};
+		}
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+	
+	std::coroutine_handle<promise_type> handle;
+};
+
+
+class SessionHost;
+
+// One client connection of the session host.  Its games run in a coroutine
+// that suspends while it waits for a line from the client or for the engine
+// pool to choose a move, and the host resumes it when either arrives.
+class Session {
+public:
+	struct LineAwaiter {
+		Session& session;
+		
+		bool await_ready() const {
+			return session.closed || session.input.find('\n') != string::npos;
+		}
+		void await_suspend(std::coroutine_handle<> h) {
+			session.waiting = h;
+		}
+		// Empty once the client has gone.
+		std::optional<string> await_resume();
+	};
+	
+	struct EngineAwaiter {
+		Session& session;
+		Player* engine;
+		Board board;
+		
+		bool await_ready() const {
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> h);
+		Move await_resume() const {
+			return session.engine_move;
+		}
+	};
+	
+	Session(SessionHost& h, int f) :
+			host(h),
+			fd(f),
+			closed(false),
+			awaiting_engine(false) {}
+	
+	~Session() {
+		if (task.handle) {
+			task.handle.destroy();
+		}
+		close(fd);
+	}
+	
+	LineAwaiter read_line() {
+		return {*this};
+	}
+	
+	EngineAwaiter engine_next_move(Player* engine, const Board& b) {
+		return {*this, engine, b};
+	}
+	
+	// Queues text for the client, writing what the socket takes now.
+	void reply(string_view text);
+	
+	SessionHost& host;
+	int fd;
+	bool closed;
+	bool awaiting_engine;
+	string input;
+	string output;
+	Move engine_move;
+	std::coroutine_handle<> waiting;
+	SessionTask task;
+};
+
+
+// Serves games to clients on a Unix socket from one thread.  An epoll loop
+// reads client lines and resumes the session coroutines waiting on them,
+// engine moves run on the engine pool and come back through an eventfd, so
+// an idle game costs only its coroutine frame and buffers.
+class SessionHost {
+public:
+	explicit SessionHost(const PlayerSpec& engine);
+	~SessionHost();
+	SessionHost(const SessionHost&) = delete;
+	SessionHost& operator=(const SessionHost&) = delete;
+	
+	// Reports to cerr and returns false if the socket can't be opened.
+	bool listen_on(const string& path);
+	
+	// Starts a session on an already connected socket.
+	void attach(int fd);
+	
+	// Serves until there is no listening socket and no session left.
+	void run();
+	
+	// Called from pool threads when an engine move is ready.
+	void complete(Session* session, Move move);
+	
+	void watch_output(Session& session, bool want_output);
+	
+private:
+	// Lines longer than this are taken as a misbehaving client.
+	static const size_t MAX_LINE = 256;
+	
+	PlayerSpec engine_spec;
+	int epoll_fd;
+	int event_fd;
+	int listen_fd;
+	unordered_map<int, unique_ptr<Session>> sessions;
+	std::mutex completed_mutex;
+	vector<std::pair<Session*, Move>> completed;
+	
+	void accept_clients();
+	void read_client(Session& session);
+	void write_client(Session& session);
+	void close_client(Session& session);
+	void resume(Session& session);
+};
+
+
+
+void test_board_status();
+void test_board_moves();
+void test_random_moves();
+void test_random_game();
+void test_endgame_database();
+void test_ultimate_board();
+void test_qubic_board();
+void test_self_play_learning();
+void test_work_stealing_pool();
+void test_threat_table();
+void test_game_log_stats();
+void test_session_host();
+void test_exact_score();
+void test_shared_position_cache();
+void test_position_ranks();
+void test_host_calibration();
+void test_latency_histogram();
+void test_sequential_test();
+void test_score_checkpoints();
+void test_player_specs();
+void test_solve_below();
+void test_root_allocation();
+void test_pondering();
+void test_variant_mcst_sides();
+void test();
+template <typename B>
+void score_games(
+		const PlayerSpec& player_one,
+		const PlayerSpec& player_two,
+		int n_games,
+		const ScoreOptions& options);
+void score_players( 
+		const PlayerSpec& player_one, 
+		const PlayerSpec& player_two,
+		int n_games,
+		const ScoreOptions& options);
+void print_score_summary(
+		ostream& os,
+		int wins,
+		int losses,
+		int ties,
+		uint64_t moves);
+void merge_checkpoints(const vector<string>& paths);
+void exact_score(const PlayerSpec& player_one, const PlayerSpec& player_two);
+vector<uint8_t> build_endgame_table(
+		const BoardGeometry& geometry,
+		uint32_t& n_reachable);
+bool write_endgame_database(
+		const string& path,
+		const BoardGeometry& geometry,
+		const vector<uint8_t>& table);
+void build_database(int side, string path);
+string default_database_path(int side);
+shared_ptr<const EndgameDatabase> shared_endgame_database();
+void learn_values(int n_games, int n_threads, string path);
+void log_stats(const vector<string>& paths);
+SessionTask play_sessions(Session& session, const PlayerSpec& engine_spec);
+shared_ptr<const LearnedValues> shared_learned_values();
+template <typename M>
+ostream& operator<<(ostream& os, const vector<M>& moves);
+template <typename M, int Capacity>
+ostream& operator<<(ostream& os, const MoveRecord<M, Capacity>& moves);
+
+
+class CLIHandler {
+public:
+	CLIHandler(int argc, char** argv) :
+			valid_player_names({
+				"random", 
+				"one_step_ahead",
+				"one_step_ahead_mcst",
+				"database",
+				"learned"}),
+			valid_variants({
+				"standard",
+				"ultimate",
+				"qubic"}) {
+		// Options are given as --name=value anywhere after the command.
+		for (int i = 1; i < argc; i++) {
+			string arg = argv[i];
+			if (arg.compare(0, 2, "--") == 0) {
+				size_t split = arg.find('=');
+				options[arg.substr(2, split - 2)] =
+					split == string::npos ? "" : arg.substr(split + 1);
+			} else {
+				args.push_back(arg);
+			}
+		}
+		n_args = size(args) + 1;
+	}
+	
+	void run_command() {
+		// Set before any thread starts so every allocation sees it.
+		alloc_tracking_enabled = options.count("track-allocs") > 0;
+		ponder_enabled = options.count("ponder") > 0;
+		if (options.count("shared-cache")) {
+			shared_cache_name = options["shared-cache"];
+			if (shared_cache_name.empty()) {
+				cerr << "--shared-cache needs the name of a segment to open." << endl;
+				return;
+			} else if (!shared_position_cache()) {
+				return;
+			}
+		}
+		if (options.count("verbose")) {
+			verbosity = 1;
+			stringstream(options["verbose"]) >> verbosity;
+		}
+		
+		if (n_args < 2) {
+			print_usage();
+		} else if (args[0] == "test") {
+			test();
+		} else if (args[0] == "random") {
+			test_random_game();
+		} else if (args[0] == "score") {
+			run_score();
+		} else if (args[0] == "bench") {
+			run_bench();
+		} else if (args[0] == "build-db") {
+			run_build_db();
+		} else if (args[0] == "learn") {
+			run_learn();
+		} else if (args[0] == "stats") {
+			run_stats();
+		} else if (args[0] == "serve") {
+			run_serve();
+		} else if (args[0] == "merge") {
+			run_merge();
+		} else if (args[0] == "exact-score") {
+			run_exact_score();
+		} else {
+			print_usage();
+		}
+	}
+	
+	void run_score() {
+		if (n_args < 5) {
+			print_usage_score();
+		} else {
+			stringstream ss;
+			int n_games;
+			string player_one_name, player_two_name;
+			ss << args[1];
+			ss >> n_games;
+			ss.str("");
+			ss.clear();
+			
+			ss << args[2];
+			ss >> player_one_name;
+			ss.str("");
+			ss.clear();
+			
+			ss << args[3];
+			ss >> player_two_name;
+			ss.str("");
+			ss.clear();
+			
+			ScoreOptions score_options = score_options_from_flags();
+			PlayerSpec player_one, player_two;
+			if (!parse_player(player_one_name, "Player one", player_one) ||
+					!parse_player(player_two_name, "Player two", player_two) ||
+					!check_players(player_one, player_two,
+						score_options.variant) ||
+					!parse_stopping_rule(score_options.stopping) ||
+					!parse_run_options(score_options)) {
+				print_usage_score();
+				return;
+			}
+			
+			score_players(player_one, player_two, n_games, score_options);
+		}
+	}
+	
+	void run_bench() {
+		int n_games = 10000;
+		string player_one_name = "one_step_ahead";
+		string player_two_name = "one_step_ahead";
+		if (n_args > 2) {
+			stringstream ss(args[1]);
+			ss >> n_games;
+		}
+		if (n_args > 4) {
+			player_one_name = args[2];
+			player_two_name = args[3];
+		}
+		
+		ScoreOptions score_options = score_options_from_flags();
+		score_options.print_games = false;
+		score_options.report_timing = true;
+		PlayerSpec player_one, player_two;
+		if (n_games < 1 ||
+				!parse_player(player_one_name, "Player one", player_one) ||
+				!parse_player(player_two_name, "Player two", player_two) ||
+				!check_players(player_one, player_two, score_options.variant)) {
+			print_usage_bench();
+			return;
+		}
+		
+		score_players(player_one, player_two, n_games, score_options);
+	}
+	
+	ScoreOptions score_options_from_flags() const {
+		ScoreOptions score_options;
+		score_options.variant = option("variant", "standard");
+		score_options.track_allocations = options.count("track-allocs") > 0;
+		score_options.latency_per_ply = options.count("latency-per-ply") > 0;
+		if (options.count("progress")) {
+			score_options.progress_interval = 10;
+			stringstream(options.at("progress")) >>
+				score_options.progress_interval;
+			score_options.report_timing = true;
+		}
+		return score_options;
+	}
+	
+	// Reads --sprt=s0,s1[,alpha,beta] or --margin=E, reporting bad values
+	// to cerr.
+	bool parse_stopping_rule(StoppingRule& rule) const {
+		if (options.count("sprt") && options.count("margin")) {
+			cerr << "Give only one of --sprt and --margin." << endl;
+			return false;
+		}
+		
+		if (options.count("sprt")) {
+			rule.kind = StoppingRule::SPRT;
+			stringstream ss(options.at("sprt"));
+			char comma;
+			bool parsed = bool(ss >> rule.s0 >> comma >> rule.s1);
+			if (parsed && ss >> comma) {
+				parsed = bool(ss >> rule.alpha >> comma >> rule.beta);
+			}
+			if (!parsed || rule.s0 < 0 || rule.s0 >= rule.s1 ||
+					rule.s1 > 1 || rule.alpha <= 0 || rule.alpha >= 1 ||
+					rule.beta <= 0 || rule.beta >= 1) {
+				cerr << "--sprt needs 0 <= s0 < s1 <= 1 and alpha, beta in (0, 1)."
+				     << endl;
+				return false;
+			}
+		} else if (options.count("margin")) {
+			rule.kind = StoppingRule::MARGIN;
+			stringstream(options.at("margin")) >> rule.margin;
+			if (rule.margin <= 0) {
+				cerr << "--margin needs a positive margin of error." << endl;
+				return false;
+			}
+		}
+		return true;
+	}
+	
+	// Reads --seed, --shard=i/n, --checkpoint and --resume, reporting bad
+	// values to cerr.
+	bool parse_run_options(ScoreOptions& score_options) const {
+		if (options.count("seed")) {
+			score_options.seeded = true;
+			if (!(stringstream(options.at("seed")) >> score_options.seed)) {
+				cerr << "--seed needs a non-negative integer." << endl;
+				return false;
+			}
+		}
+		if (options.count("shard")) {
+			stringstream ss(options.at("shard"));
+			char slash = 0;
+			ss >> score_options.shard_index >> slash >> score_options.n_shards;
+			if (ss.fail() || slash != '/' || score_options.n_shards < 1 ||
+					score_options.shard_index < 0 ||
+					score_options.shard_index >= score_options.n_shards) {
+				cerr << "--shard needs i/n with 0 <= i < n." << endl;
+				return false;
+			}
+		}
+		score_options.checkpoint_path = option("checkpoint", "");
+		score_options.resume = options.count("resume") > 0;
+		if (score_options.resume && score_options.checkpoint_path.empty()) {
+			cerr << "--resume needs --checkpoint=FILE." << endl;
+			return false;
+		}
+		return true;
+	}
+	
+	// Parses a player spec, reporting unknown names and bad settings to
+	// cerr under label.
+	bool parse_player(
+			const string& text,
+			const string& label,
+			PlayerSpec& spec) const {
+		if (!spec.parse(text)) {
+			return false;
+		}
+		if (valid_player_names.count(spec.name) == 0) {
+			cerr << label << " name, " << spec.name << ", not found." << endl;
+			return false;
+		}
+		return true;
+	}
+	
+	// Reports players the variant can't use to cerr.
+	bool check_players(
+			const PlayerSpec& player_one,
+			const PlayerSpec& player_two,
+			const string& variant) {
+		if (valid_variants.count(variant) == 0) {
+			cerr << "Variant, " << variant << ", not found." << endl;
+			return false;
+		}
+		
+		bool uses_database = player_one.name == "database" ||
+			player_two.name == "database";
+		bool uses_learned = player_one.name == "learned" ||
+			player_two.name == "learned";
+		if ((uses_database || uses_learned) && variant != "standard") {
+			cerr << "The database and learned players only play the "
+			     << "standard board." << endl;
+			return false;
+		}
+		for (const PlayerSpec* spec : {&player_one, &player_two}) {
+			if (variant != "standard" && (spec->threads > 0 ||
+					spec->samples == AUTO_SAMPLES ||
+					spec->move_time > 0 || spec->solve_below > 0 ||
+					spec->root != OneStepAheadMCSTPlayer::HEURISTIC ||
+					spec->ponder)) {
+				cerr << "Players on the " << variant << " board only take "
+				     << "the samples setting." << endl;
+				return false;
+			}
+		}
+		if (uses_database && !shared_endgame_database()) {
+			cerr << "The database player needs a 3x3 database, "
+			     << "create one with build-db." << endl;
+			return false;
+		}
+		if (uses_learned && !shared_learned_values()) {
+			cerr << "The learned player needs learned values, "
+			     << "create them with learn." << endl;
+			return false;
+		}
+		return true;
+	}
+	
+	void run_build_db() {
+		int side = 3;
+		if (n_args > 2) {
+			stringstream ss(args[1]);
+			ss >> side;
+		}
+		if (side < 2 || side > DB_MAX_SIDE) {
+			cerr << "Board side must be between 2 and "
+			     << DB_MAX_SIDE << "." << endl;
+			print_usage_build_db();
+			return;
+		}
+		
+		string path = n_args > 3 ? args[2] : default_database_path(side);
+		build_database(side, path);
+	}
+	
+	void run_learn() {
+		int n_games = 1000000;
+		if (n_args > 2) {
+			stringstream ss(args[1]);
+			ss >> n_games;
+		}
+		int n_threads = 0;
+		stringstream(option("threads", std::to_string(
+			std::max(1u, thread::hardware_concurrency())))) >> n_threads;
+		if (n_games < 1 || n_threads < 1) {
+			print_usage_learn();
+			return;
+		}
+		
+		string path = n_args > 3 ? args[2] : DEFAULT_LEARNED_PATH;
+		learn_values(n_games, n_threads, path);
+	}
+	
+	void run_stats() {
+		if (n_args < 3) {
+			print_usage_stats();
+			return;
+		}
+		log_stats(vector<string>(args.begin() + 1, args.end()));
+	}
+	
+	void run_exact_score() {
+		PlayerSpec player_one, player_two;
+		if (n_args < 4 ||
+				!parse_player(args[1], "Player one", player_one) ||
+				!parse_player(args[2], "Player two", player_two) ||
+				!check_players(player_one, player_two, "standard")) {
+			print_usage_exact_score();
+			return;
+		}
+		exact_score(player_one, player_two);
+	}
+	
+	void run_merge() {
+		if (n_args < 3) {
+			print_usage_merge();
+			return;
+		}
+		merge_checkpoints(vector<string>(args.begin() + 1, args.end()));
+	}
+	
+	void run_serve() {
+		PlayerSpec engine;
+		if (n_args < 3 || !parse_player(
+				n_args > 3 ? args[2] : "one_step_ahead_mcst", "Engine", engine) ||
+				!check_players(engine, engine, "standard")) {
+			print_usage_serve();
+			return;
+		}
+		
+		SessionHost host(engine);
+		if (host.listen_on(args[1])) {
+			calibrate_players(engine, engine);
+			host.run();
+		}
+	}
+	
+	void print_usage();
+	void print_usage_score();
+	void print_usage_build_db();
+	void print_usage_learn();
+	void print_usage_bench();
+	void print_usage_stats();
+	void print_usage_serve();
+	void print_usage_merge();
+	void print_usage_exact_score();
+	
+private:
+	int n_args;
+	vector<string> args;
+	unordered_map<string, string> options;
+	unordered_set<string> valid_player_names;
+	unordered_set<string> valid_variants;
+	
+	string option(const string& name, const string& default_value) const {
+		auto found = options.find(name);
+		return found == options.end() ? default_value : found->second;
+	}
+};
+
+
+int main(int argc, char** argv) {
+	cout << "Tictactoe Engine" << endl;
+	
 	CLIHandler cli(argc, argv);
 	
-	cli.run_command();
+	cli.run_command();
+	
+	return 0;
+}
+
+
+void test() {
+	test_board_status();
+	test_board_moves();
+	test_random_moves();
+	test_random_game();
+	test_endgame_database();
+	test_ultimate_board();
+	test_qubic_board();
+	test_self_play_learning();
+	test_work_stealing_pool();
+	test_threat_table();
+	test_game_log_stats();
+	test_session_host();
+	test_exact_score();
+	test_shared_position_cache();
+	test_position_ranks();
+	test_host_calibration();
+	test_latency_histogram();
+	test_sequential_test();
+	test_score_checkpoints();
+	test_player_specs();
+	test_solve_below();
+	test_root_allocation();
+	test_pondering();
+	test_variant_mcst_sides();
+}
+
+void SequentialTest::print_result(ostream& os) const {
+	os << "Mean score " << mean() << " +/- " << half_width()
+	   << " (95% confidence) after " << n_games << " games";
+	if (rule.kind == StoppingRule::SPRT) {
+		os << ", SPRT ";
+		if (n_games < MIN_GAMES) {
+			os << "not applied before the " << MIN_GAMES << " game minimum";
+		} else if (!conclusive()) {
+			os << "inconclusive";
+		} else if (llr() >= upper_bound()) {
+			os << "accepts H1 (score " << rule.s1 << ")";
+		} else {
+			os << "accepts H0 (score " << rule.s0 << ")";
+		}
+		os << ", LLR " << llr() << " in [" << lower_bound() << ", "
+		   << upper_bound() << "], alpha " << rule.alpha
+		   << " beta " << rule.beta;
+	} else if (rule.kind == StoppingRule::MARGIN && n_games < MIN_GAMES) {
+		os << ", margin " << rule.margin << " not applied before the "
+		   << MIN_GAMES << " game minimum";
+	} else if (rule.kind == StoppingRule::MARGIN && !conclusive()) {
+		os << ", margin " << rule.margin << " not reached";
+	}
+	os << "." << endl;
+}
+
+void print_score_summary(
+		ostream& os,
+		int wins,
+		int losses,
+		int ties,
+		uint64_t moves) {
+	int n_games = wins + losses + ties;
+	double win_percent = static_cast<double>(wins) / n_games * 100;
+	double loss_percent = static_cast<double>(losses) / n_games * 100;
+	double tie_percent = static_cast<double>(ties) / n_games * 100;
+	double mean_moves = static_cast<double>(moves) / n_games;
+	
+	os << "Wins (%) "
+	   << "Losses (%) "
+	   << "Ties (%) "
+	   << "Mean Moves\n"
+	   << std::setw(8) << win_percent  << " "
+	   << std::setw(10) << loss_percent << " "
+	   << std::setw(8) << tie_percent  << " "
+	   << std::setw(10) << mean_moves
+	   << endl;
+}
+
+bool PlayerSpec::parse(const string& spec_text) {
+	text = spec_text;
+	size_t colon = text.find(':');
+	name = text.substr(0, colon);
+	if (colon == string::npos) {
+		return true;
+	}
+	
+	stringstream settings(text.substr(colon + 1));
+	string setting;
+	while (std::getline(settings, setting, ',')) {
+		size_t equals = setting.find('=');
+		string key = setting.substr(0, equals);
+		string value = equals == string::npos ? "" : setting.substr(equals + 1);
+		if (name != "one_step_ahead_mcst") {
+			cerr << "Player " << name << " takes no settings, got " << key
+			     << "." << endl;
+			return false;
+		}
+		
+		stringstream ss(value);
+		bool valid = false;
+		if (key == "samples" && value == "auto") {
+			samples = AUTO_SAMPLES;
+			valid = true;
+		} else if (key == "samples") {
+			valid = ss >> samples && ss.eof() && samples > 0;
+		} else if (key == "threads") {
+			valid = ss >> threads && ss.eof() && threads > 0;
+		} else if (key == "move_time" || key == "latency") {
+			// A number with unit us, ms or s.
+			double seconds;
+			string unit;
+			valid = ss >> seconds && seconds > 0;
+			std::getline(ss, unit);
+			if (unit == "us") {
+				seconds /= 1e6;
+			} else if (unit == "ms") {
+				seconds /= 1e3;
+			} else if (unit != "s") {
+				valid = false;
+			}
+			(key == "latency" ? latency : move_time) = seconds;
+		} else if (key == "solve_below") {
+			valid = ss >> solve_below && ss.eof() &&
+				solve_below >= 1 && solve_below <= 9;
+		} else if (key == "root") {
+			valid = value == "heuristic" || value == "ucb" || value == "halving";
+			root = value == "ucb" ? OneStepAheadMCSTPlayer::UCB :
+				value == "halving" ? OneStepAheadMCSTPlayer::HALVING :
+				OneStepAheadMCSTPlayer::HEURISTIC;
+		} else if (key == "ponder") {
+			valid = value == "0" || value == "1";
+			ponder = value == "1";
+		} else {
+			cerr << "Unknown setting " << key << " for " << name
+			     << ", expected samples, threads, move_time, latency, solve_below,"
+				 << " root or ponder." << endl;
+			return false;
+		}
+		if (!valid) {
+			cerr << "Bad value " << value << " for " << key << " of " << name
+			     << "." << endl;
+			return false;
+		}
+	}
+	if (latency > 0 && samples != AUTO_SAMPLES) {
+		cerr << "latency sets the samples of " << name
+		     << ", give it with samples=auto." << endl;
+		return false;
+	}
+	return true;
+}
+
+// Writes path through a temporary file renamed over it, so a reader or a
+// crash never leaves half a file.  kind names the file in errors.
+bool replace_file(
+		const string& path,
+		const string& kind,
+		const std::function<void(ostream&)>& write_contents) {
+	string temporary_path = path + ".tmp";
+	{
+		ofstream out(temporary_path);
+		write_contents(out);
+		if (!out.flush()) {
+			cerr << "Could not write " << kind << " " << temporary_path << "." << endl;
+			return false;
+		}
+	}
+	if (rename(temporary_path.c_str(), path.c_str()) != 0) {
+		cerr << "Could not replace " << kind << " " << path << "." << endl;
+		return false;
+	}
+	return true;
+}
+
+bool ScoreCheckpoint::write(const string& path) const {
+	return replace_file(path, "checkpoint", [this](ostream& out) {
+		out << "tictactoe-score-checkpoint 1\n"
+		    << "player_one " << player_one_name << "\n"
+		    << "player_two " << player_two_name << "\n"
+		    << "variant " << variant << "\n"
+		    << "n_games " << n_games << "\n"
+		    << "seed " << seed << "\n"
+		    << "shard " << shard_index << "/" << n_shards << "\n"
+		    << "next_game " << next_game << "\n"
+		    << "wins " << wins << "\n"
+		    << "losses " << losses << "\n"
+		    << "ties " << ties << "\n"
+		    << "moves " << moves << "\n";
+	});
+}
+
+HostCalibration HostCalibration::current_host() {
+	HostCalibration calibration;
+	array<char, 256> name{};
+	gethostname(name.data(), name.size() - 1);
+	calibration.host = name[0] ? name.data() : "unknown";
+	calibration.n_cpus = std::max(1u, thread::hardware_concurrency());
+	return calibration;
+}
+
+HostCalibration HostCalibration::measure() {
+	static const double BENCHMARK_SECONDS = 0.2;
+	HostCalibration calibration = current_host();
+	calibration.single_rate = OneStepAheadMCSTPlayer::benchmark(1, BENCHMARK_SECONDS);
+	calibration.parallel_rate = OneStepAheadMCSTPlayer::benchmark(
+		engine_pool().size() + 1, BENCHMARK_SECONDS);
+	return calibration;
+}
+
+bool HostCalibration::write(const string& path) const {
+	return replace_file(path, "calibration", [this](ostream& out) {
+		out << "tictactoe-calibration 1\n"
+		    << "host " << host << "\n"
+		    << "n_cpus " << n_cpus << "\n"
+		    << "single_rate " << single_rate << "\n"
+		    << "parallel_rate " << parallel_rate << "\n";
+	});
+}
+
+bool HostCalibration::read(const string& path) {
+	ifstream in(path);
+	string magic, key;
+	int version = 0;
+	in >> magic >> version;
+	bool valid = magic == "tictactoe-calibration" && version == 1;
+	valid = valid && in >> key >> host && key == "host";
+	valid = valid && in >> key >> n_cpus && key == "n_cpus";
+	valid = valid && in >> key >> single_rate && key == "single_rate";
+	valid = valid && in >> key >> parallel_rate && key == "parallel_rate";
+	return valid && single_rate > 0 && parallel_rate > 0;
+}
+
+void HostCalibration::budget(
+		double latency,
+		int max_threads,
+		int& samples,
+		int& threads) const {
+	// Leaves room for task startup and the decision's own work.
+	static const double HEADROOM = 0.8;
+	int pool_threads = engine_pool().size() + 1;
+	double efficiency = std::min(1.0, parallel_rate / (single_rate*pool_threads));
+	threads = std::max(1, std::min(max_threads, pool_threads));
+	for (;;) {
+		double rate = threads == 1 ? single_rate : single_rate*threads*efficiency;
+		samples = std::max(1, static_cast<int>(rate*latency*HEADROOM));
+		int usable = std::max(1, samples / OneStepAheadMCSTPlayer::MIN_CHUNK_SAMPLES);
+		if (usable >= threads) {
+			break;
+		}
+		threads = usable;
+	}
+}
+
+const HostCalibration& host_calibration() {
+	static const HostCalibration calibration = [] {
+		const char* env_path = getenv("TICTACTOE_CALIBRATION");
+		string path = env_path ? env_path : DEFAULT_CALIBRATION_PATH;
+		HostCalibration loaded;
+		if (loaded.read(path) && loaded.same_host(HostCalibration::current_host())) {
+			return loaded;
+		}
+		cerr << "Calibrating rollout speed for " << path << "..." << endl;
+		HostCalibration measured = HostCalibration::measure();
+		measured.write(path);
+		return measured;
+	}();
+	return calibration;
+}
+
+void calibrate_players(const PlayerSpec& player_one, const PlayerSpec& player_two) {
+	if (player_one.samples == AUTO_SAMPLES || player_two.samples == AUTO_SAMPLES) {
+		host_calibration();
+	}
+}
+
+bool ScoreCheckpoint::read(const string& path) {
+	ifstream in(path);
+	if (!in) {
+		cerr << "Could not open checkpoint " << path << "." << endl;
+		return false;
+	}
+	
+	string magic, key;
+	int version = 0;
+	char slash = 0;
+	in >> magic >> version;
+	bool valid = magic == "tictactoe-score-checkpoint" && version == 1;
+	valid = valid && in >> key >> player_one_name && key == "player_one";
+	valid = valid && in >> key >> player_two_name && key == "player_two";
+	valid = valid && in >> key >> variant && key == "variant";
+	valid = valid && in >> key >> n_games && key == "n_games";
+	valid = valid && in >> key >> seed && key == "seed";
+	valid = valid && in >> key >> shard_index >> slash >> n_shards &&
+		key == "shard" && slash == '/';
+	valid = valid && in >> key >> next_game && key == "next_game";
+	valid = valid && in >> key >> wins && key == "wins";
+	valid = valid && in >> key >> losses && key == "losses";
+	valid = valid && in >> key >> ties && key == "ties";
+	valid = valid && in >> key >> moves && key == "moves";
+	if (!valid || n_shards < 1 || shard_index < 0 || shard_index >= n_shards ||
+			next_game < 0 || next_game > shard_games() ||
+			played() != next_game) {
+		cerr << "Checkpoint " << path << " is not a valid score checkpoint." << endl;
+		return false;
+	}
+	return true;
+}
+
+// Sums the checkpoints of the shards of one run.  The counters are exact,
+// so the merged result is the result of the whole run.
+void merge_checkpoints(const vector<string>& paths) {
+	ScoreCheckpoint merged;
+	vector<bool> seen_shards;
+	int n_complete = 0;
+	for (size_t i = 0; i < size(paths); i++) {
+		ScoreCheckpoint shard;
+		if (!shard.read(paths[i])) {
+			return;
+		}
+		if (i == 0) {
+			merged = shard;
+			merged.next_game = merged.wins = merged.losses = merged.ties = 0;
+			merged.moves = 0;
+			seen_shards.assign(shard.n_shards, false);
+		} else if (!shard.same_run(merged)) {
+			cerr << "Checkpoint " << paths[i] << " is from a different run than "
+			     << paths[0] << "." << endl;
+			return;
+		}
+		if (seen_shards[shard.shard_index]) {
+			cerr << "Shard " << shard.shard_index << " is given twice." << endl;
+			return;
+		}
+		seen_shards[shard.shard_index] = true;
+		
+		merged.wins += shard.wins;
+		merged.losses += shard.losses;
+		merged.ties += shard.ties;
+		merged.moves += shard.moves;
+		n_complete += shard.next_game == shard.shard_games();
+	}
+	
+	cout << merged.player_one_name << " vs " << merged.player_two_name
+	     << " (" << merged.variant << "), " << merged.played() << " of "
+		 << merged.n_games << " games, " << n_complete << " of "
+		 << merged.n_shards << " shards complete" << endl;
+	if (merged.played() > 0) {
+		print_score_summary(cout, merged.wins, merged.losses, merged.ties,
+			merged.moves);
+	}
+}
+
+// Outcome of every reachable position under one_step_ahead play on both
+// sides, the rollout policy of the MCST player, by position rank.  Built on
+// first use.
+const vector<ExactOutcome>& rollout_outcomes() {
+	static const vector<ExactOutcome> outcomes = [] {
+		OneStepAheadPlayer one(1);
+		OneStepAheadPlayer two(2);
+		ExactScorer scorer(&one, &two);
+		BoardGeometry geometry(3);
+		vector<ExactOutcome> table(N_POSITION_RANKS);
+		vector<int> cells;
+		for (uint32_t rank = 0; rank < N_POSITION_RANKS; rank++) {
+			geometry.decode(CODE_OF_RANK[rank], cells);
+			scorer.solve(Board(cells), table[rank]);
+		}
+		return table;
+	}();
+	return outcomes;
+}
+
+void exact_score(const PlayerSpec& player_one, const PlayerSpec& player_two) {
+	// Sampling players are turned down by the scorer anyway, checked here
+	// so a calibrated budget does not measure the host for nothing.
+	for (const PlayerSpec* spec : {&player_one, &player_two}) {
+		if (spec->samples == AUTO_SAMPLES) {
+			cerr << "Player " << spec->text
+			     << " can't list its moves, use score instead." << endl;
+			return;
+		}
+	}
+	
+	auto start = std::chrono::steady_clock::now();
+	unique_ptr<Player> one(find_player_by_name(player_one, 1));
+	unique_ptr<Player> two(find_player_by_name(player_two, 2));
+	ExactScorer scorer(one.get(), two.get());
+	ExactOutcome outcome;
+	if (!scorer.solve(Board(), outcome)) {
+		cerr << "Player "
+		     << (scorer.failed_player() == 0 ? player_one.text : player_two.text)
+			 << " can't list its moves, use score instead." << endl;
+		return;
+	}
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+	
+	cout << "Wins (%) "
+	     << "Losses (%) "
+		 << "Ties (%) "
+		 << "Mean Moves\n"
+		 << std::setw(8) << outcome.win*100  << " "
+		 << std::setw(10) << outcome.loss*100 << " "
+		 << std::setw(8) << outcome.tie*100  << " "
+		 << std::setw(10) << outcome.moves
+		 << endl;
+	cout << "Exact over " << scorer.positions() << " positions in "
+	     << elapsed.count()*1e3 << " ms." << endl;
+}
+
+void score_players( 
+		const PlayerSpec& player_one, 
+		const PlayerSpec& player_two,
+		int n_games,
+		const ScoreOptions& options) {
+	if (options.variant == "ultimate") {
+		score_games<UltimateBoard>(player_one, player_two, n_games, options);
+	} else if (options.variant == "qubic") {
+		score_games<QubicBoard>(player_one, player_two, n_games, options);
+	} else {
+		score_games<Board>(player_one, player_two, n_games, options);
+	}
+}
+
+template <typename B>
+void score_games(
+		const PlayerSpec& player_one_spec,
+		const PlayerSpec& player_two_spec,
+		int n_games,
+		const ScoreOptions& options) {
+	typedef typename GameTraits<B>::player_type player_type;
+	typedef typename GameTraits<B>::game_type game_type;
+	
+	// Metrics from player_one's perspective, over this shard's games.
+	ScoreCheckpoint state;
+	state.player_one_name = player_one_spec.text;
+	state.player_two_name = player_two_spec.text;
+	state.variant = options.variant;
+	state.n_games = n_games;
+	state.seed = options.seeded ? options.seed :
+		(static_cast<uint64_t>(fresh_seed()) << 32 | fresh_seed());
+	state.shard_index = options.shard_index;
+	state.n_shards = options.n_shards;
+	
+	if (options.resume && access(options.checkpoint_path.c_str(), F_OK) == 0) {
+		ScoreCheckpoint saved;
+		if (!saved.read(options.checkpoint_path)) {
+			return;
+		}
+		if (!options.seeded) {
+			state.seed = saved.seed;
+		}
+		if (!saved.same_run(state) || saved.shard_index != state.shard_index) {
+			cerr << "Checkpoint " << options.checkpoint_path
+			     << " is for a different run." << endl;
+			return;
+		}
+		state = saved;
+		cerr << "Resuming after " << state.next_game << " of "
+		     << state.shard_games() << " games." << endl;
+	}
+	
+	int n_shard_games = state.shard_games();
+	int first_game = state.next_game;
+	vector<decltype(game_type::action_log)> game_logs(n_shard_games);
+	vector<int> results(n_shard_games);
+	unique_ptr<atomic<bool>[]> finished(new atomic<bool>[n_shard_games]);
+	for (int i = 0; i < n_shard_games; i++) {
+		finished[i] = false;
+	}
+	
+	// Games run on the engine pool, a window of them ahead of the one
+	// being reported so results still print in order.
+	WorkStealingPool& pool = engine_pool();
+	TaskGroup group(pool);
+	int window = 4*(pool.size() + 1);
+	int n_submitted = first_game;
+	// Metrics of the games in flight, added in game order so games queued
+	// past a stop are left out.  Game g's slot is reused by game
+	// g + window + 1, which is only submitted once g has been reported.
+	vector<unique_ptr<GameMetrics>> metric_slots(window + 1);
+	ScoreMetrics metrics(options.latency_per_ply);
+	calibrate_players(player_one_spec, player_two_spec);
+	ProgressReporter progress(
+		n_shard_games - first_game, options.progress_interval);
+	auto start = std::chrono::steady_clock::now();
+	auto last_checkpoint = start;
+	
+	// Results are tested in game order, so a stop depends only on the games
+	// before it.  Games already queued past that point are skipped.
+	SequentialTest sequential_test(options.stopping);
+	sequential_test.add(1.0, state.wins);
+	sequential_test.add(0.0, state.losses);
+	sequential_test.add(0.5, state.ties);
+	atomic<bool> stopped(sequential_test.conclusive());
+	
+	for (int i = first_game; i < n_shard_games && !stopped; i++) {
+		for (; n_submitted < n_shard_games && n_submitted <= i + window; n_submitted++) {
+			int game_index = n_submitted;
+			group.run([&, game_index] {
+				if (stopped.load(std::memory_order_relaxed)) {
+					return;
+				}
+				unique_ptr<GameMetrics>& slot =
+					metric_slots[game_index % metric_slots.size()];
+				slot.reset(new GameMetrics());
+				GameMetrics& game_metrics = *slot;
+				{
+					AllocationScope allocation_scope(
+						game_metrics.game_allocations);
+					SeedScope seeds(game_seed(state.seed,
+						state.shard_index + game_index*state.n_shards));
+					unique_ptr<player_type> player_one(
+						GameTraits<B>::find_player(player_one_spec, 1));
+					unique_ptr<player_type> player_two(
+						GameTraits<B>::find_player(player_two_spec, 2));
+					
+					game_type game(player_one.get(), player_two.get());
+					game.observer = &game_metrics;
+					game.play();
+					
+					game_logs[game_index] = game.action_log;
+					results[game_index] = game.board.is_won() ?
+						game.board.winning_player() : TIE;
+				}
+				progress.game_finished();
+				finished[game_index].store(true, std::memory_order_release);
+			});
+		}
+		group.wait_until([&finished, i] {
+			return finished[i].load(std::memory_order_acquire);
+		});
+		metrics.add_game(*metric_slots[i % metric_slots.size()]);
+		
+		if (results[i] == 1) {
+			state.wins++;
+			sequential_test.add(1.0);
+		} else if (results[i] == 2) {
+			state.losses++;
+			sequential_test.add(0.0);
+		} else {
+			state.ties++;
+			sequential_test.add(0.5);
+		}
+		state.moves += size(game_logs[i]);
+		state.next_game = i + 1;
+		
+		if (options.print_games) {
+			cout << game_logs[i] << " "
+			     << (results[i] == 1 ? "W" : results[i] == 2 ? "L" : "T")
+				 << endl;
+		}
+		if (sequential_test.conclusive()) {
+			stopped = true;
+		}
+		
+		auto now = std::chrono::steady_clock::now();
+		if (!options.checkpoint_path.empty() &&
+				now - last_checkpoint >= std::chrono::seconds(CHECKPOINT_SECONDS)) {
+			state.write(options.checkpoint_path);
+			last_checkpoint = now;
+		}
+	}
+	group.wait();
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+	if (!options.checkpoint_path.empty()) {
+		state.write(options.checkpoint_path);
+	}
+	
+	int n_played = state.next_game - first_game;
+	double mean_moves = state.played() > 0 ?
+		static_cast<double>(state.moves) / state.played() : 0;
+	print_score_summary(cout, state.wins, state.losses, state.ties, state.moves);
+	
+	if (options.stopping.kind != StoppingRule::NONE) {
+		sequential_test.print_result(cout);
+	}
+	if (options.report_timing) {
+		cout << "Played " << n_played << " games in " << elapsed.count() << " s ("
+		     << n_played / elapsed.count() << " games/s, "
+			 << mean_moves*n_played / elapsed.count() << " moves/s";
+		if (progress.rollouts() > 0) {
+			cout << ", " << progress.rollouts() / elapsed.count()
+			     << " rollouts/s";
+		}
+		cout << ")." << endl;
+	}
+	metrics.print_latencies(cout, player_one_spec.text, player_two_spec.text);
+	if (options.track_allocations) {
+		metrics.print_allocations(cout, player_one_spec.text, player_two_spec.text);
+	}
+}
+
+
+Player* find_player_by_name(const PlayerSpec& spec, int player) {
+	if (spec.name == "random") {
+		return new RandomPlayer(player);
+	} else if (spec.name == "one_step_ahead") {
+		return new OneStepAheadPlayer(player);
+	} else if (spec.name == "one_step_ahead_mcst") {
+		// A time budget alone lets the player sample until it runs out.
+		int n_samples = spec.samples > 0 ? spec.samples :
+			spec.move_time > 0 ? std::numeric_limits<int>::max() : 10000;
+		int n_threads = spec.threads;
+		if (spec.samples == AUTO_SAMPLES) {
+			host_calibration().budget(
+				spec.latency > 0 ? spec.latency : DEFAULT_LATENCY_SECONDS,
+				spec.threads > 0 ? spec.threads : std::numeric_limits<int>::max(),
+				n_samples, n_threads);
+		}
+		OneStepAheadMCSTPlayer* mcst = new OneStepAheadMCSTPlayer(player, n_samples);
+		mcst->set_threads(n_threads);
+		mcst->set_move_time(spec.move_time);
+		mcst->set_solve_below(spec.solve_below);
+		mcst->set_root_allocation(spec.root);
+		mcst->set_pondering(spec.ponder || ponder_enabled);
+		mcst->set_shared_cache(shared_position_cache());
+		return mcst;
+	} else if (spec.name == "database") {
+		return new DatabasePlayer(player, shared_endgame_database());
+	} else if (spec.name == "learned") {
+		return new LearnedPlayer(player, shared_learned_values());
+	} else {
+		return 0; // If valid player not found.
+	}
+}
+
+
+void test_board_status() {
+	static const vector<vector<int>> test_boards = {
+			{0, 0, 0, 0, 0, 0, 0, 0, 0},
+			{1, 1, 1, 0, 0, 0, 0, 0, 0},
+			{0, 0, 0, 1, 1, 1, 0, 0, 0},
+			{0, 0, 0, 0, 0, 0, 1, 1, 1},
+			{1, 0, 0, 1, 0, 0, 1, 0, 0},
+			{0, 1, 0, 0, 1, 0, 0, 1, 0},
+			{0, 0, 1, 0, 0, 1, 0, 0, 1},
+			{1, 0, 0, 0, 1, 0, 0, 0, 1},
+			{0, 0, 1, 0, 1, 0, 1, 0, 0},
+			{2, 2, 2, 0, 0, 0, 0, 0, 0},
+			{0, 0, 0, 2, 2, 2, 0, 0, 0},
+			{0, 0, 0, 0, 0, 0, 2, 2, 2},
+			{2, 0, 0, 2, 0, 0, 2, 0, 0},
+			{0, 2, 0, 0, 2, 0, 0, 2, 0},
+			{0, 0, 2, 0, 0, 2, 0, 0, 2},
+			{2, 0, 0, 0, 2, 0, 0, 0, 2},
+			{0, 0, 2, 0, 2, 0, 2, 0, 0},
+			{1, 2, 2, 2, 1, 1, 1, 2, 2}
+		};
+	
+	for (auto tb : test_boards) {
+		Board b(tb);
+		cout << b << endl;
+	}
+}
+
+
+void test_board_moves() {
+	Board b1, b2;
+	static const vector<int> player_seq1 = {1, 2, 1, 2, 1, 2, 1, 2, 1};
+	static const vector<int> player_seq2 = {2, 1, 2, 1, 2, 1, 2, 1, 2};
+	static const vector<int> position_seq = {1, 0, 2, 4, 3, 5, 7, 6, 8};
+	
+	cout << b1;
+	for (int i = 0; i < 9; i++) {
+		Move m(position_seq[i], player_seq1[i]);
+		b1.apply_move(m);
+		cout << b1;
+	}
+	
+	cout << b2;
+	for (int i = 0; i < 9; i++) {
+		Move m(position_seq[i], player_seq2[i]);
+		b2.apply_move(m);
+		cout << b2;
+	}
+}
+
+void test_random_moves() {
+	Board b;
+	RandomPlayer p1(1);
+	RandomPlayer p2(2);
+	
+	cout << b;
+	for (int i = 0; i < 4; i++) {
+		Move m = p1.next_move(b);
+		cout << m << endl;
+		b.apply_move(m);
+		cout << b;
+		m = p2.next_move(b);
+		cout << m << endl;
+		b.apply_move(m);
+		cout << b;
+	}
+}
+
+void test_random_game() {
+	RandomPlayer p1(1), p2(2);
+	Tictactoe(&p1, &p2).play();
+}
+
+void test_ultimate_board() {
+	UltimateBoard b;
+	static const vector<int> position_seq = {40, 36, 0, 4, 37, 13, 38};
+	
+	for (int pos : position_seq) {
+		b.apply_move(VariantMove(pos, b.next_player()));
+	}
+	cout << b;
+	cout << "Valid moves " << b.valid_moves(b.next_player()) << endl;
+	
+	VariantRandomPlayer<UltimateBoard> p1(1), p2(2);
+	VariantGame<UltimateBoard> game(&p1, &p2);
+	game.play();
+	cout << game.board << game.action_log << endl;
+}
+
+void test_qubic_board() {
+	cout << "Qubic lines " << size(QUBIC_LINES.lines)
+	     << " (expected 76)" << endl;
+	
+	// Player 1 fills the vertical line through position 5.
+	QubicBoard b;
+	static const vector<int> position_seq = {5, 0, 21, 1, 37, 2};
+	for (int pos : position_seq) {
+		b.apply_move(VariantMove(pos, b.next_player()));
+	}
+	cout << "Winning cells for player 1 " << b.winning_cells(1)
+	     << " (expected " << (uint64_t(1) << 53) << ")" << endl;
+	b.apply_move(VariantMove(53, 1));
+	cout << b;
+}
+
+void test_self_play_learning() {
+	SelfPlayTrainer trainer;
+	trainer.train(100000, 1);
+	shared_ptr<const LearnedValues> learned =
+		make_shared<LearnedValues>(trainer.snapshot());
+	
+	int losses = 0;
+	for (int i = 0; i < 100; i++) {
+		LearnedPlayer p1(1, learned);
+		RandomPlayer p2(2);
+		Tictactoe game(&p1, &p2);
+		game.play();
+		losses += game.board.winning_player() == 2;
+	}
+	cout << "Learned player losses to random " << losses
+	     << " (expected near 0)" << endl;
+}
+
+void test_work_stealing_pool() {
+	// Tasks that wait on nested tasks must not deadlock the pool.
+	atomic<int> count(0);
+	TaskGroup outer(engine_pool());
+	for (int i = 0; i < 8; i++) {
+		outer.run([&count] {
+			TaskGroup inner(engine_pool());
+			for (int j = 0; j < 100; j++) {
+				inner.run([&count] {
+					count++;
+				});
+			}
+			inner.wait();
+		});
+	}
+	outer.wait();
+	cout << "Nested pool tasks run " << count << " (expected 800)" << endl;
+}
+
+void test_threat_table() {
+	// Compare table lookups against trying every move on boards in play.
+	BoardGeometry geometry(3);
+	vector<int> cells;
+	int n_boards = 0;
+	int mismatches = 0;
+	for (uint32_t code = 0; code < N_POSITION_CODES; code++) {
+		geometry.decode(code, cells);
+		Board b(cells);
+		if (!b.is_playing()) {
+			continue;
+		}
+		n_boards++;
+		for (int player = 1; player <= 2; player++) {
+			uint16_t expected = 0;
+			for (Move m : b.valid_moves(player)) {
+				Board next_board = b;
+				next_board.apply_move(m);
+				if (next_board.is_won()) {
+					expected |= 1 << m.position;
+				}
+			}
+			uint16_t found = THREAT_TABLE[b.player_mask(player)] & b.empty_mask();
+			mismatches += found != expected;
+		}
+	}
+	cout << "Threat table mismatches " << mismatches << " over "
+	     << n_boards << " boards (expected 0)" << endl;
+}
+
+void test_game_log_stats() {
+	GameLogStats stats;
+	stats.add_text(
+		"Tictactoe Engine\n"
+		"1@4 2@0 1@8 2@2 1@1 2@7 1@3 2@5 1@6 T\n"
+		"1@4 2@1 1@0 2@8 1@6 2@2 1@3 W\r\n"
+		"1@4 2@0 1@9x W\n"
+		"Wins (%) Losses (%) Ties (%) Mean Moves\n"
+		"1@2 2@4 1@0 2@6 1@1 L");
+	cout << "Log stats games " << stats.games() << " (expected 3), skipped "
+	     << stats.skipped() << " (expected 3)" << endl;
+}
+
+void test_session_host() {
+	static const int N_SESSIONS = 4;
+	PlayerSpec engine;
+	engine.parse("one_step_ahead");
+	SessionHost host(engine);
+	array<int, N_SESSIONS> clients;
+	for (int i = 0; i < N_SESSIONS; i++) {
+		int fds[2];
+		socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		host.attach(fds[0]);
+		clients[i] = fds[1];
+	}
+	thread host_thread([&host] {
+		host.run();
+	});
+	
+	auto read_line = [](int fd) {
+		string line;
+		char c;
+		while (read(fd, &c, 1) == 1 && c != '\n') {
+			line += c;
+		}
+		return line;
+	};
+	auto send_line = [](int fd, const string& line) {
+		string text = line + "\n";
+		return write(fd, text.data(), size(text)) == static_cast<ssize_t>(size(text));
+	};
+	
+	// The other sessions stay suspended while each one is played through.
+	int n_finished = 0;
+	bool illegal_rejected = false;
+	for (int i = 0; i < N_SESSIONS; i++) {
+		int side = i % 2 + 1;
+		send_line(clients[i], "play " + std::to_string(side));
+		bool ok = read_line(clients[i]) == "start " + std::to_string(side);
+		
+		Board b;
+		while (ok && b.is_playing()) {
+			if (b.next_player() == side) {
+				if (i == 0 && !illegal_rejected) {
+					send_line(clients[i], "9");
+					illegal_rejected = read_line(clients[i]) == "illegal 9";
+				}
+				Move m = b.valid_moves(side)[0];
+				send_line(clients[i], std::to_string(m.position));
+				b.apply_move(m);
+			} else {
+				string line = read_line(clients[i]);
+				ok = line.compare(0, 7, "move " + std::to_string(other_player(side)) + "@") == 0;
+				if (ok) {
+					b.apply_move(Move(std::stoi(line.substr(7)), other_player(side)));
+				}
+			}
+		}
+		n_finished += ok && read_line(clients[i]).compare(0, 4, "end ") == 0;
+		send_line(clients[i], "quit");
+		close(clients[i]);
+	}
+	host_thread.join();
+	
+	cout << "Session games finished " << n_finished << " (expected "
+	     << N_SESSIONS << "), illegal move rejected " << illegal_rejected
+		 << " (expected 1)" << endl;
+}
+
+void test_exact_score() {
+	RandomPlayer p1(1);
+	RandomPlayer p2(2);
+	ExactScorer scorer(&p1, &p2);
+	ExactOutcome outcome;
+	scorer.solve(Board(), outcome);
+	cout << "Exact random game win " << outcome.win << " (expected 0.584921), loss "
+	     << outcome.loss << " (expected 0.288095), tie " << outcome.tie
+		 << " (expected 0.126984)" << endl;
+}
+
+void test_variant_mcst_sides() {
+	// Player two's rollouts must seat its own rollout player second.
+	static const int N_GAMES = 60;
+	int wins = 0;
+	for (int i = 0; i < N_GAMES; i++) {
+		VariantRandomPlayer<UltimateBoard> p1(1);
+		VariantMCSTPlayer<UltimateBoard> p2(2, 100);
+		VariantGame<UltimateBoard> game(&p1, &p2);
+		game.play();
+		wins += game.board.is_won() && game.board.winning_player() == 2;
+	}
+	cout << "Player two ultimate MCST won at least 80% against random "
+	     << (wins >= 0.8*N_GAMES) << " (expected 1)" << endl;
+}
+
+void test_pondering() {
+	// After blocking at 2 the player threatens 2-4-6, so 4 is the only
+	// reply pondered.
+	Board b({2, 2, 0, 1, 0, 0, 1, 0, 0});
+	const int n = 300;
+	OneStepAheadMCSTPlayer mcst(1, n);
+	mcst.set_pondering(true);
+	Move m = mcst.next_move(b);
+	
+	// Give the pool time to ponder the reply in full.
+	uint64_t rollouts_before = rollouts_played;
+	for (int i = 0; i < 500 && rollouts_played - rollouts_before < n; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	
+	b.apply_move(m);
+	b.apply_move(Move(4, 2));
+	rollouts_before = rollouts_played;
+	mcst.next_move(b);
+	cout << "Pondered move " << static_cast<int>(m.position)
+		 << " (expected 2), fresh rollouts after expected reply "
+		 << rollouts_played - rollouts_before << " (expected 0)" << endl;
+}
+
+void test_root_allocation() {
+	// Player one wins at 2 and must not spend more than its budget.
+	Board b({1, 1, 0, 2, 2, 0, 0, 0, 0});
+	const array<OneStepAheadMCSTPlayer::RootAllocation, 2> rules = {
+		OneStepAheadMCSTPlayer::UCB, OneStepAheadMCSTPlayer::HALVING};
+	const array<const char*, 2> names = {"UCB", "Halving"};
+	for (int r = 0; r < 2; r++) {
+		OneStepAheadMCSTPlayer mcst(1, 300);
+		mcst.set_root_allocation(rules[r]);
+		uint64_t rollouts_before = rollouts_played;
+		Move m = mcst.next_move(b);
+		cout << names[r] << " root move " << static_cast<int>(m.position)
+			 << " (expected 2), over budget " << (rollouts_played - rollouts_before > 300)
+			 << " (expected 0)" << endl;
+	}
+}
+
+void test_solve_below() {
+	// With solve_below=9 every move from the empty board is valued exactly,
+	// so the player takes the best move under the rollout players without
+	// playing a rollout.
+	Board empty;
+	double best_score = -1;
+	int best_position = 0;
+	for (Move m : empty.valid_moves(1)) {
+		Board next_board = empty;
+		next_board.apply_move(m);
+		const ExactOutcome& outcome = rollout_outcomes()[next_board.position_rank()];
+		double score = outcome.win + 0.5*outcome.tie;
+		if (score > best_score) {
+			best_score = score;
+			best_position = m.position;
+		}
+	}
+	OneStepAheadMCSTPlayer exact(1, 1000);
+	exact.set_solve_below(9);
+	uint64_t rollouts_before = rollouts_played;
+	Move exact_move = exact.next_move(empty);
+	uint64_t exact_rollouts = rollouts_played - rollouts_before;
+	
+	// Four crosses and no noughts can't come up in play, so the board has no
+	// rank and is played out rather than looked up.
+	Board unreachable({1, 1, 0, 1, 1, 0, 0, 0, 0});
+	OneStepAheadMCSTPlayer fallback(1, 1000);
+	fallback.set_solve_below(9);
+	Board after = unreachable;
+	after.apply_move(fallback.next_move(unreachable));
+	cout << "Solved opening " << static_cast<int>(exact_move.position) << " (expected "
+	     << best_position << "), rollouts " << exact_rollouts
+		 << " (expected 0), unranked board won " << after.is_won()
+		 << " (expected 1)" << endl;
+}
+
+void test_player_specs() {
+	PlayerSpec full;
+	bool full_valid = full.parse(
+		"one_step_ahead_mcst:samples=2000,threads=4,move_time=10ms,solve_below=5,"
+		"root=halving,ponder=1");
+	bool full_fields = full.name == "one_step_ahead_mcst" && full.samples == 2000 &&
+		full.threads == 4 && std::abs(full.move_time - 0.01) < 1e-12 &&
+		full.solve_below == 5 && full.root == OneStepAheadMCSTPlayer::HALVING &&
+		full.ponder;
+	
+	// Each of these is reported to cerr and rejected.
+	stringstream errors;
+	std::streambuf* saved_err = cerr.rdbuf(errors.rdbuf());
+	const vector<string> bad_specs = {
+		"one_step_ahead_mcst:depth=3",
+		"one_step_ahead_mcst:samples=0",
+		"one_step_ahead_mcst:samples=12x",
+		"one_step_ahead_mcst:move_time=10",
+		"one_step_ahead_mcst:solve_below=10",
+		"one_step_ahead_mcst:root=best",
+		"one_step_ahead_mcst:ponder=yes",
+		"one_step_ahead_mcst:latency=20ms",
+		"random:samples=10"};
+	int n_rejected = 0;
+	for (const string& text : bad_specs) {
+		PlayerSpec spec;
+		n_rejected += !spec.parse(text);
+	}
+	
+	char program[] = "tictactoe";
+	char* argv[] = {program};
+	CLIHandler handler(1, argv);
+	PlayerSpec plain, threaded;
+	plain.parse("one_step_ahead_mcst:samples=100");
+	threaded.parse("one_step_ahead_mcst:threads=2");
+	bool variant_plain = handler.check_players(plain, plain, "qubic");
+	bool variant_threaded = handler.check_players(threaded, plain, "qubic");
+	bool standard_threaded = handler.check_players(threaded, plain, "standard");
+	cerr.rdbuf(saved_err);
+	
+	cout << "Player spec parsed " << (full_valid && full_fields) << " (expected 1), bad specs rejected "
+	     << n_rejected << " (expected " << size(bad_specs) << "), qubic takes samples "
+		 << variant_plain << " (expected 1), threads " << variant_threaded
+		 << " (expected 0), standard takes threads " << standard_threaded
+		 << " (expected 1)" << endl;
+}
+
+void test_score_checkpoints() {
+	ScoreCheckpoint written;
+	written.player_one_name = "one_step_ahead";
+	written.player_two_name = "random";
+	written.variant = "standard";
+	written.n_games = 60;
+	written.seed = 7;
+	written.shard_index = 1;
+	written.n_shards = 3;
+	written.next_game = 12;
+	written.wins = 8;
+	written.losses = 1;
+	written.ties = 3;
+	written.moves = 81;
+	written.write("test_round_trip.checkpoint");
+	ScoreCheckpoint read;
+	bool valid = read.read("test_round_trip.checkpoint");
+	unlink("test_round_trip.checkpoint");
+	bool same = valid && read.same_run(written) &&
+		read.shard_index == written.shard_index &&
+		read.next_game == written.next_game && read.wins == written.wins &&
+		read.losses == written.losses && read.ties == written.ties &&
+		read.moves == written.moves;
+	
+	// A whole seeded run, its two shards, and a run stopped early then
+	// resumed should all come to the same totals.
+	PlayerSpec one, two;
+	one.parse("one_step_ahead");
+	two.parse("random");
+	ScoreOptions options;
+	options.print_games = false;
+	options.seeded = true;
+	options.seed = 7;
+	const vector<string> paths = {"test_full.checkpoint", "test_shard_0.checkpoint",
+		"test_shard_1.checkpoint", "test_resumed.checkpoint"};
+	
+	stringstream quiet;
+	std::streambuf* saved_out = cout.rdbuf(quiet.rdbuf());
+	std::streambuf* saved_err = cerr.rdbuf(quiet.rdbuf());
+	options.checkpoint_path = paths[0];
+	score_players(one, two, 60, options);
+	options.n_shards = 2;
+	for (int shard = 0; shard < 2; shard++) {
+		options.shard_index = shard;
+		options.checkpoint_path = paths[1 + shard];
+		score_players(one, two, 60, options);
+	}
+	options.n_shards = 1;
+	options.shard_index = 0;
+	options.checkpoint_path = paths[3];
+	options.stopping.kind = StoppingRule::MARGIN;
+	options.stopping.margin = 1.0;
+	score_players(one, two, 60, options);
+	ScoreCheckpoint stopped;
+	stopped.read(paths[3]);
+	options.stopping.kind = StoppingRule::NONE;
+	options.resume = true;
+	score_players(one, two, 60, options);
+	
+	stringstream merged;
+	cout.rdbuf(merged.rdbuf());
+	merge_checkpoints({paths[1], paths[2]});
+	cout.rdbuf(saved_out);
+	cerr.rdbuf(saved_err);
+	
+	array<ScoreCheckpoint, 4> results;
+	for (int i = 0; i < 4; i++) {
+		results[i].read(paths[i]);
+		unlink(paths[i].c_str());
+	}
+	stringstream full_summary;
+	print_score_summary(full_summary, results[0].wins, results[0].losses,
+		results[0].ties, results[0].moves);
+	auto same_totals = [](const ScoreCheckpoint& a, const ScoreCheckpoint& b) {
+		return a.wins == b.wins && a.losses == b.losses && a.ties == b.ties &&
+			a.moves == b.moves;
+	};
+	cout << "Checkpoint round trip " << same << " (expected 1), merged shards match "
+	     << (merged.str().find(full_summary.str()) != string::npos)
+		 << " (expected 1), stopped after " << stopped.next_game
+		 << " (expected 20), resumed run matches " << same_totals(results[0], results[3])
+		 << " (expected 1)" << endl;
+}
+
+void test_sequential_test() {
+	StoppingRule sprt;
+	sprt.kind = StoppingRule::SPRT;
+	sprt.s0 = 0.4;
+	sprt.s1 = 0.6;
+	SequentialTest short_run(sprt);
+	short_run.add(1.0, 15);
+	short_run.add(0.0, 4);
+	SequentialTest full_run(sprt);
+	full_run.add(1.0, 15);
+	full_run.add(0.0, 5);
+	cout << "SPRT bounds [" << full_run.lower_bound() << ", " << full_run.upper_bound()
+	     << "] (expected [-2.94444, 2.94444]), LLR " << full_run.llr()
+		 << " (expected 5.33333), conclusive at 19 games " << short_run.conclusive()
+		 << " (expected 0), at 20 " << full_run.conclusive() << " (expected 1)" << endl;
+	
+	StoppingRule margin;
+	margin.kind = StoppingRule::MARGIN;
+	margin.margin = 0.2;
+	SequentialTest even(margin);
+	even.add(1.0, 10);
+	even.add(0.0, 10);
+	margin.margin = 0.25;
+	SequentialTest wider(margin);
+	wider.add(1.0, 10);
+	wider.add(0.0, 10);
+	cout << "Margin half width " << even.half_width() << " (expected 0.219135), within 0.2 "
+	     << even.conclusive() << " (expected 0), within 0.25 " << wider.conclusive()
+		 << " (expected 1)" << endl;
+}
+
+void test_latency_histogram() {
+	// Values below 16 have buckets of their own, above that a bucket spans
+	// 1/16th of its power of two and reports its upper end.
+	LatencyHistogram small;
+	for (uint64_t v = 0; v < 16; v++) {
+		small.add(v);
+	}
+	auto bucket_top = [](uint64_t v) {
+		LatencyHistogram h;
+		h.add(v);
+		h.add(std::numeric_limits<uint64_t>::max());
+		return h.percentile(0.5);
+	};
+	LatencyHistogram largest;
+	largest.add(std::numeric_limits<uint64_t>::max());
+	cout << "Latency percentiles p50 of 0..15 " << small.percentile(0.5)
+	     << " (expected 7), p100 " << small.percentile(1.0)
+		 << " (expected 15), bucket tops 16 " << bucket_top(16)
+		 << " (expected 16), 32 " << bucket_top(32) << " (expected 33), 34 "
+		 << bucket_top(34) << " (expected 35), 1000 " << bucket_top(1000)
+		 << " (expected 1023), largest capped at max "
+		 << (largest.percentile(0.99) == largest.max()) << " (expected 1), empty "
+		 << LatencyHistogram().percentile(0.5) << " (expected 0)" << endl;
+}
+
+void test_host_calibration() {
+	HostCalibration written = HostCalibration::current_host();
+	written.single_rate = 1e6;
+	written.parallel_rate = 1e6*(engine_pool().size() + 1);
+	string path = "test_tictactoe.calibration";
+	written.write(path);
+	HostCalibration read;
+	bool valid = read.read(path);
+	unlink(path.c_str());
+	cout << "Calibration read back " << (valid && read.same_host(written) &&
+		read.single_rate == written.single_rate) << " (expected 1)" << endl;
+	
+	int samples, threads;
+	written.budget(0.05, 1, samples, threads);
+	cout << "Budget for 50ms on one thread " << samples << " samples (expected 40000)"
+	     << endl;
+	written.budget(0.0001, 4, samples, threads);
+	cout << "Budget for 0.1ms " << samples << " samples (expected 80) on "
+	     << threads << " threads (expected 1)" << endl;
+}
+
+void test_position_ranks() {
+	int n_ranked = 0;
+	int round_trip_errors = 0;
+	for (uint32_t code = 0; code < N_POSITION_CODES; code++) {
+		if (RANK_OF_CODE[code] != NO_RANK) {
+			n_ranked++;
+			round_trip_errors += CODE_OF_RANK[RANK_OF_CODE[code]] != code;
+		}
+	}
+	
+	// Codes kept by apply_move against ones computed from the cells.
+	vector<int> cells;
+	int code_errors = 0;
+	for (int i = 0; i < 100; i++) {
+		RandomPlayer p1(1);
+		RandomPlayer p2(2);
+		Tictactoe game(&p1, &p2);
+		game.play();
+		Board b;
+		for (Move m : game.action_log) {
+			b.apply_move(m);
+			cells.assign(9, 0);
+			for (int pos = 0; pos < 9; pos++) {
+				cells[pos] = b.player_mask(1) >> pos & 1 ? 1 :
+					b.player_mask(2) >> pos & 1 ? 2 : 0;
+			}
+			code_errors += Board(cells).position_code() != b.position_code() ||
+				b.position_rank() == NO_RANK;
+		}
+	}
+	cout << "Ranked positions " << n_ranked << " (expected " << N_POSITION_RANKS
+	     << "), round trip errors " << round_trip_errors
+		 << " (expected 0), incremental code errors " << code_errors
+		 << " (expected 0)" << endl;
+}
+
+void test_shared_position_cache() {
+	string name = "/tictactoe_test_" + std::to_string(getpid());
+	shared_ptr<SharedPositionCache> writer = SharedPositionCache::open(name);
+	shared_ptr<SharedPositionCache> reader = SharedPositionCache::open(name);
+	shm_unlink(name.c_str());
+	if (!writer || !reader) {
+		return;
+	}
+	
+	// Writers on several threads, through a second mapping of the segment.
+	RolloutTotals one;
+	one.wins[4] = 0.75;
+	one.ties[4] = 0.25;
+	one.samples[4] = 1;
+	vector<thread> writers;
+	for (int t = 0; t < 4; t++) {
+		writers.emplace_back([&writer, &one] {
+			for (int i = 0; i < 1000; i++) {
+				writer->add(0, one);
+			}
+		});
+	}
+	for (thread& t : writers) {
+		t.join();
+	}
+	// Adds that meet another writer are dropped, whole.
+	RolloutTotals totals;
+	reader->read(0, totals);
+	bool kept = totals.samples[4] > 0 && totals.samples[4] <= 4000;
+	bool consistent = totals.wins[4] == 0.75*totals.samples[4] &&
+		totals.ties[4] == 0.25*totals.samples[4];
+	cout << "Shared cache adds kept " << kept << " (expected 1), totals consistent "
+	     << consistent << " (expected 1)" << endl;
+	
+	// A writer that died holding the entry is taken over once its lock
+	// is stale, and its partial totals are cleared.
+	SharedCacheEntry* entry = writer->find(0, false);
+	entry->locked_at = SharedPositionCache::monotonic_milliseconds() -
+		2*SharedPositionCache::STALE_MILLISECONDS;
+	entry->sequence |= 1;
+	entry->samples[4] = 12345;
+	RolloutTotals locked;
+	bool locked_read = reader->read(0, locked);
+	writer->add(0, one);
+	RolloutTotals taken_over;
+	reader->read(0, taken_over);
+	cout << "Locked entry read " << locked_read << " (expected 0), samples after "
+	     << "takeover " << taken_over.samples[4] << " (expected 1)" << endl;
+	
+	// A second player finds the first one's samples and plays none itself.
+	Board b({1, 0, 0, 0, 2, 0, 0, 0, 0});
+	OneStepAheadMCSTPlayer first(1, 1000);
+	first.set_shared_cache(writer);
+	Move first_move = first.next_move(b);
+	OneStepAheadMCSTPlayer second(1, 1000);
+	second.set_shared_cache(reader);
+	uint64_t rollouts_before = rollouts_played;
+	Move second_move = second.next_move(b);
+	cout << "Cached decision " << second_move << " (expected " << first_move
+	     << "), rollouts " << rollouts_played - rollouts_before << " (expected 0)" << endl;
+}
+
+void test_endgame_database() {
+	BoardGeometry geometry(3);
+	uint32_t n_reachable;
+	vector<uint8_t> table = build_endgame_table(geometry, n_reachable);
+	cout << "Reachable positions " << n_reachable
+	     << " (expected 5478)" << endl;
+
+	static const vector<vector<int>> test_boards = {
+			{0, 0, 0, 0, 0, 0, 0, 0, 0},
+			{1, 1, 0, 2, 2, 0, 0, 0, 0},
+			{1, 2, 0, 0, 1, 0, 0, 0, 0},
+			{1, 1, 1, 2, 2, 0, 0, 0, 0}
+		};
+	static const char* value_names[] = {"unreachable", "win", "loss", "draw"};
+	for (auto tb : test_boards) {
+		Board b(tb);
+		uint8_t entry = table[b.position_code()];
+		cout << b << "Player " << b.next_player() << " to move: "
+		     << value_names[db_value(entry)] << " in "
+			 << db_distance(entry) << endl;
+	}
+
+	string path = "test_endgame.db";
+	write_endgame_database(path, geometry, table);
+	shared_ptr<const EndgameDatabase> db = EndgameDatabase::open(path);
+	unlink(path.c_str());
+	if (!db) {
+		return;
+	}
+
+	int losses = 0;
+	for (int i = 0; i < 100; i++) {
+		DatabasePlayer p1(1, db);
+		RandomPlayer p2(2);
+		Tictactoe game(&p1, &p2);
+		game.play();
+		losses += game.board.winning_player() == 2;
+	}
+	cout << "Database player losses to random " << losses
+	     << " (expected 0)" << endl;
+}
+
+
+void CLIHandler::print_usage() {
+	cout << "\nUsage: ./tictactoe.exe COMMAND COMMAND_ARGS\n\n"
+	     << "COMMAND       One of the following:\n"
+		 << "  test        Runs a series of tests of game engine features.\n"
+		 << "  random      Plays game between to players randomly choosing moves.\n"
+		 << "  score       Plays a game n times between two players and returns score by wins, losses, and ties by player one.\n"
+		 << "  build-db    Solves every reachable position and writes the endgame database.\n"
+		 << "  learn       Trains position values by self-play on all cores.\n"
+		 << "  bench       Plays games without game logs and reports throughput.\n"
+		 << "  stats       Reports openings, results by first move and game lengths from score logs.\n"
+		 << "  serve       Hosts games against an engine player for clients on a Unix socket.\n"
+		 << "  merge       Combines the checkpoints of a sharded score run.\n"
+		 << "  exact-score Works out the exact outcome chances between two players, without sampling.\n\n"
+		 << "COMMAND_ARGS  Arguments to each command.\n"
+		 << "  test        None.\n"
+		 << "  random      None.\n"
+		 << "  score       n_games, player_one_name, player_two_name.\n"
+		 << "  build-db    [side], [path].\n"
+		 << "  learn       [n_games], [path], [--threads=N].\n"
+		 << "  bench       [n_games], [player_one_name player_two_name], [--variant=NAME].\n"
+		 << "  stats       log_file [log_file ...].\n"
+		 << "  serve       socket_path, [engine_player_name].\n"
+		 << "  merge       checkpoint_file [checkpoint_file ...].\n"
+		 << "  exact-score player_one_name, player_two_name.\n\n"
+		 << "score and bench take --track-allocs to report heap allocations per game,\n"
+		 << "per move decision and per player.  --verbose prints each MCST decision.\n"
+		 << "--ponder lets MCST players keep searching on the opponent's turn.\n"
+		 << "--shared-cache=NAME pools MCST samples with other processes given the same NAME.\n"
+		 << "--progress[=SECONDS] prints throughput and ETA to stderr, every 10 s by default.\n\n"
+		 << endl;
+}
+
+void CLIHandler::print_usage_score() {
+	cout << "\nUsage: ./tictactoe.exe score n_games player_one_name player_two_name [--variant=NAME]\n\n"
+	     << "  n_games          Number of games to play.\n"
+		 << "  player_one_name  Name of player one, one of random, one_step_ahead, one_step_ahead_mcst, database, learned.  This determines the players move choices.\n"
+		 << "  player_two_name  Name of player two, see player_one_name.\n"
+		 << "                   one_step_ahead_mcst takes settings after a colon, e.g.\n"
+		 << "                   one_step_ahead_mcst:samples=2000,threads=8,move_time=10ms,ponder=1\n"
+		 << "                   samples per move (default 10000, or as many as move_time allows),\n"
+		 << "                   or auto to set samples and threads from this host's rollout speed,\n"
+		 << "                   measured once into tictactoe.calibration (or TICTACTOE_CALIBRATION),\n"
+		 << "                   for moves of about latency (default 50ms), e.g. samples=auto,latency=20ms,\n"
+		 << "                   threads: most sample chunks run at once, move_time in us, ms or s,\n"
+		 << "                   solve_below: value positions with fewer empty cells exactly, 1 to 9,\n"
+		 << "                   root: spread samples over the first moves by the rollout player's\n"
+		 << "                   choice (heuristic, default), UCB1 (ucb) or successive halving (halving),\n"
+		 << "                   ponder: search on the opponent's turn.  Other boards take samples only.\n"
+		 << "  --variant        Board to play on, standard (default), ultimate or qubic.\n"
+		 << "  --track-allocs   Report heap allocations per game, per move and per player.\n"
+		 << "  --progress       Print games/s, rollouts/s and ETA to stderr every SECONDS (default 10).\n"
+		 << "  --sprt           s0,s1[,alpha,beta]: stop once player one's mean score (win 1, tie 0.5)\n"
+		 << "                   is shown to be s0 or s1, with error rates alpha and beta (default 0.05).\n"
+		 << "  --margin         Stop once the 95% confidence interval of the mean score is within +/- E.\n"
+		 << "  --seed           Seed of the run.  Each game's players are seeded from it and the game index.\n"
+		 << "  --shard          i/n: play only games g with g % n == i, to split a run across processes.\n"
+		 << "  --checkpoint     FILE to save the run's progress in every " << CHECKPOINT_SECONDS << " s and at the end.\n"
+		 << "  --resume         Continue from the --checkpoint file if it exists.\n"
+		 << "  --latency-per-ply  Break the move latency table down by ply as well as by player.\n\n"
+		 << "The database player reads tictactoe.db, or the file named by TICTACTOE_DB.\n"
+		 << "The learned player reads tictactoe.learned, or the file named by TICTACTOE_LEARNED.\n\n"
+		 << endl;
+}
+
+void CLIHandler::print_usage_bench() {
+	cout << "\nUsage: ./tictactoe.exe bench [n_games] [player_one_name player_two_name] [--variant=NAME] [--track-allocs]\n\n"
+	     << "  n_games          Number of games to play, default 10000.\n"
+		 << "  player_one_name  Player one, default one_step_ahead.  See score for names and settings.\n"
+		 << "  player_two_name  Player two, default one_step_ahead.\n"
+		 << "  --variant        Board to play on, standard (default), ultimate or qubic.\n"
+		 << "  --track-allocs   Report heap allocations per game, per move and per player.\n"
+		 << "  --progress       Print games/s, rollouts/s and ETA to stderr every SECONDS (default 10).\n"
+		 << "  --latency-per-ply  Break the move latency table down by ply as well as by player.\n\n"
+		 << endl;
+}
+
+void CLIHandler::print_usage_stats() {
+	cout << "\nUsage: ./tictactoe.exe stats log_file [log_file ...]\n\n"
+	     << "  log_file  Output of score, one \"1@4 2@0 ... W\" line per game.  Other lines are skipped.\n\n"
+		 << "Prints results, results by first move, the most common two move openings\n"
+		 << "and the distribution of game lengths.\n\n"
+		 << endl;
+}
+
+void CLIHandler::print_usage_exact_score() {
+	cout << "\nUsage: ./tictactoe.exe exact-score player_one_name player_two_name\n\n"
+	     << "  player_one_name  Player one, one of random, one_step_ahead, database, learned.\n"
+		 << "  player_two_name  Player two, see player_one_name.\n\n"
+		 << "Walks the game tree weighted by each player's move probabilities, so the\n"
+		 << "result has no sampling error.  MCST players can't list their moves.\n\n"
+		 << endl;
+}
+
+void CLIHandler::print_usage_merge() {
+	cout << "\nUsage: ./tictactoe.exe merge checkpoint_file [checkpoint_file ...]\n\n"
+	     << "  checkpoint_file  Checkpoint of one shard of a score run, from score --shard=i/n --checkpoint=FILE.\n\n"
+		 << "Prints the score table over the games of every shard given.\n\n"
+		 << endl;
+}
+
+void CLIHandler::print_usage_serve() {
+	cout << "\nUsage: ./tictactoe.exe serve socket_path [engine_player_name]\n\n"
+	     << "  socket_path         Unix socket to listen on.\n"
+		 << "  engine_player_name  Player the clients play against, default one_step_ahead_mcst.\n"
+		 << "                      Takes settings as score does.\n\n"
+		 << "Each connection plays any number of games, one line per message:\n"
+		 << "  client: play 1|2   Start a game on that side.\n"
+		 << "  server: start 1|2\n"
+		 << "  client: N          Play cell N, 0 to 8.  Answered by illegal N if it can't be played.\n"
+		 << "  server: move P@N   The engine, player P, played cell N.\n"
+		 << "  server: end LOG R  Game over, with the game log and W, L or T for player one.\n"
+		 << "  client: quit       Close the connection.\n\n"
+		 << endl;
+}
+
+void CLIHandler::print_usage_learn() {
+	cout << "\nUsage: ./tictactoe.exe learn [n_games] [path] [--threads=N]\n\n"
+	     << "  n_games    Number of self-play games, default 1000000.\n"
+		 << "  path       Output file, default " << DEFAULT_LEARNED_PATH << ".\n"
+		 << "  --threads  Training threads, default one per core.\n\n"
+		 << endl;
+}
+
+void CLIHandler::print_usage_build_db() {
+	cout << "\nUsage: ./tictactoe.exe build-db [side] [path]\n\n"
+	     << "  side  Side of the square board, 2 to " << DB_MAX_SIDE << ", default 3.\n"
+		 << "  path  Output file, default tictactoe.db for 3x3 and tictactoe_NxN.db otherwise.\n\n"
+		 << endl;
+}
+
+
+void Tictactoe::play() {
+	// If game has already been played. Do nothing.
+	if (!board.is_playing()) {
+		return;
+	}
+	
+	for (; 
+			board.is_playing(); 
+			next_player_idx = other_player_index(next_player_idx)) {
+		if (observer) {
+			observer->before_move(action_log.size(), next_player_idx);
+		}
+		Move m = players[next_player_idx]->next_move(board);
+		if (observer) {
+			observer->after_move(action_log.size(), next_player_idx);
+		}
+		board.apply_move(m);
+		action_log.push_back(m);
+		//cout << *this << endl;
+	}
+}
+
+
+ostream& operator<<(ostream& os, const Tictactoe& game) {
+	cout << game.board;
+	cout << "Moves: ";
+	for (Move m : game.action_log) {
+		cout << m << " ";
+	}
+	cout << endl;
+}
+
+
+ostream& operator<<(ostream& os, const Board& b) {
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			os << static_cast<int>(b.board[3*i + j])
+			   << (j == 2 ? "\n" : "|");
+		}
+		if (i < 2) {
+			os << std::string(5, '-')
+			   << endl;
+		}
+	}
+	
+	if (b.is_won()) {
+		os << "Player " << b.winning_player() << " wins." << endl;
+	} else if (b.is_tie()) {
+		os << "Tie." << endl;
+	} else {
+		os << "Playing." << endl;
+	}
+	
+	return os;
+}
+
+void Board::update_status() {
+	static const vector<int> players = {1, 2};
+	
+	bool player_won = false;
+	for (auto player : players) {
+		// Win by rows
+		for (int row = 0; row < 3; row++) {
+			player_won = player_won || 
+				(board[3*row] == player) &&
+				(board[3*row + 1] == player) &&
+				(board[3*row + 2] == player);
+		}
+		
+		// Win by columns
+		for (int column = 0; column < 3; column++) {
+			player_won = player_won ||
+				(board[column] == player) &&
+				(board[3 + column] == player) &&
+				(board[6 + column] == player);
+			
+		}
+		
+		// Win by diagonals
+		player_won = player_won ||
+			((board[0] == player) &&
+			 (board[3+1] == player) &&
+			 (board[6+2] == player)) ||
+			((board[2] == player) &&
+			 (board[3+1] == player) &&
+			 (board[6] == player));
+
+		if (player_won) {
+			status = player;
+			return;
+		}
+	}
+	
+	bool board_tied = true;
+	for (auto b : board) {
+		if (b == EMPTY) {
+			board_tied = false;
+			break;
+		}
+	}
+	if (board_tied) {
+		status = TIE;
+		return;
+	}
+	
+	status = PLAYING;
+}
+
+
+ostream& operator<<(ostream& os, const Move& m) {
+	os << static_cast<int>(m.player) << "@" << static_cast<int>(m.position);
+	return os;
+}
+
+ostream& operator<<(ostream& os, const VariantMove& m) {
+	os << static_cast<int>(m.player) << "@" << static_cast<int>(m.position);
+	return os;
+}
+
+ostream& operator<<(ostream& os, const UltimateBoard& b) {
+	for (int row = 0; row < 9; row++) {
+		for (int column = 0; column < 9; column++) {
+			int sub = 3*(row / 3) + column / 3;
+			int cell = 3*(row % 3) + column % 3;
+			os << b.cell(9*sub + cell)
+			   << (column == 8 ? "\n" : column % 3 == 2 ? " | " : "|");
+		}
+		if (row == 2 || row == 5) {
+			os << std::string(21, '=')
+			   << endl;
+		}
+	}
+	
+	if (b.is_won()) {
+		os << "Player " << b.winning_player() << " wins." << endl;
+	} else if (b.is_tie()) {
+		os << "Tie." << endl;
+	} else if (b.forced_sub_board() >= 0) {
+		os << "Playing in sub-board " << b.forced_sub_board() << "." << endl;
+	} else {
+		os << "Playing in any sub-board." << endl;
+	}
+	
+	return os;
+}
+
+ostream& operator<<(ostream& os, const QubicBoard& b) {
+	for (int row = 0; row < 4; row++) {
+		for (int layer = 0; layer < 4; layer++) {
+			for (int column = 0; column < 4; column++) {
+				os << b.cell(16*layer + 4*row + column)
+				   << (column < 3 ? "|" : layer < 3 ? "   " : "\n");
+			}
+		}
+	}
+	
+	if (b.is_won()) {
+		os << "Player " << b.winning_player() << " wins." << endl;
+	} else if (b.is_tie()) {
+		os << "Tie." << endl;
+	} else {
+		os << "Playing." << endl;
+	}
+	
+	return os;
+}
+
+template <typename M>
+ostream& operator<<(ostream& os, const vector<M>& moves) {
+	for (int i = 0; i < static_cast<int>(size(moves))-1; i++) {
+		os << moves[i] << " ";
+	}
+	os << moves[size(moves)-1];
+	return os;
+}
+
+template <typename M, int Capacity>
+ostream& operator<<(ostream& os, const MoveRecord<M, Capacity>& moves) {
+	for (int i = 0; i < moves.size(); i++) {
+		os << (i > 0 ? " " : "") << moves[i];
+	}
+	return os;
+}
+
+BoardGeometry::BoardGeometry(int s) :
+		side(s),
+		n_cells(s*s),
+		n_codes(1) {
+	for (int i = 0; i < n_cells; i++) {
+		powers.push_back(n_codes);
+		n_codes *= 3;
+	}
+	
+	vector<int> diagonal, anti_diagonal;
+	for (int i = 0; i < side; i++) {
+		vector<int> row, column;
+		for (int j = 0; j < side; j++) {
+			row.push_back(side*i + j);
+			column.push_back(side*j + i);
+		}
+		lines.push_back(row);
+		lines.push_back(column);
+		diagonal.push_back(side*i + i);
+		anti_diagonal.push_back(side*i + side - 1 - i);
+	}
+	lines.push_back(diagonal);
+	lines.push_back(anti_diagonal);
+}
+
+int BoardGeometry::status(const vector<int>& cells) const {
+	for (const vector<int>& line : lines) {
+		int first = cells[line[0]];
+		if (first == EMPTY) {
+			continue;
+		}
+		bool complete = true;
+		for (int pos : line) {
+			if (cells[pos] != first) {
+				complete = false;
+				break;
+			}
+		}
+		if (complete) {
+			return first;
+		}
+	}
 	
-	return 0;
+	for (int c : cells) {
+		if (c == EMPTY) {
+			return PLAYING;
+		}
+	}
+	return TIE;
+}
+
+void BoardGeometry::decode(uint32_t code, vector<int>& cells) const {
+	cells.resize(n_cells);
+	for (int i = 0; i < n_cells; i++) {
+		cells[i] = code % 3;
+		code /= 3;
+	}
+}
+
+
+// Retrograde analysis over the reachable positions.  A forward pass collects
+// the positions by number of marks, then positions are solved from full boards
+// back to the empty board so every child is solved before its parent.
+vector<uint8_t> build_endgame_table(
+		const BoardGeometry& geometry,
+		uint32_t& n_reachable) {
+	vector<uint8_t> table(geometry.n_codes, DB_UNREACHABLE);
+	vector<bool> reached(geometry.n_codes, false);
+	vector<vector<uint32_t>> layers(geometry.n_cells + 1);
+	vector<int> cells;
+	
+	layers[0].push_back(0);
+	reached[0] = true;
+	for (int depth = 0; depth < geometry.n_cells; depth++) {
+		int player = depth % 2 == 0 ? 1 : 2;
+		for (uint32_t code : layers[depth]) {
+			geometry.decode(code, cells);
+			if (geometry.status(cells) != PLAYING) {
+				continue;
+			}
+			for (int pos = 0; pos < geometry.n_cells; pos++) {
+				if (cells[pos] != EMPTY) {
+					continue;
+				}
+				uint32_t child = code + player*geometry.powers[pos];
+				if (!reached[child]) {
+					reached[child] = true;
+					layers[depth + 1].push_back(child);
+				}
+			}
+		}
+	}
+	
+	n_reachable = 0;
+	for (int depth = geometry.n_cells; depth >= 0; depth--) {
+		int player = depth % 2 == 0 ? 1 : 2;
+		n_reachable += size(layers[depth]);
+		for (uint32_t code : layers[depth]) {
+			geometry.decode(code, cells);
+			int status = geometry.status(cells);
+			if (status == TIE) {
+				table[code] = db_entry(DB_DRAW, 0);
+				continue;
+			} else if (status != PLAYING) {
+				// The previous move won the game.
+				table[code] = db_entry(DB_LOSS, 0);
+				continue;
+			}
+			
+			int fastest_win = -1;
+			int fastest_draw = -1;
+			int slowest_loss = -1;
+			for (int pos = 0; pos < geometry.n_cells; pos++) {
+				if (cells[pos] != EMPTY) {
+					continue;
+				}
+				uint8_t child = table[code + player*geometry.powers[pos]];
+				int distance = db_distance(child) + 1;
+				if (db_value(child) == DB_LOSS) {
+					if (fastest_win < 0 || distance < fastest_win) {
+						fastest_win = distance;
+					}
+				} else if (db_value(child) == DB_DRAW) {
+					if (fastest_draw < 0 || distance < fastest_draw) {
+						fastest_draw = distance;
+					}
+				} else if (distance > slowest_loss) {
+					slowest_loss = distance;
+				}
+			}
+			
+			if (fastest_win >= 0) {
+				table[code] = db_entry(DB_WIN, fastest_win);
+			} else if (fastest_draw >= 0) {
+				table[code] = db_entry(DB_DRAW, fastest_draw);
+			} else {
+				table[code] = db_entry(DB_LOSS, slowest_loss);
+			}
+		}
+	}
+	
+	return table;
+}
+
+bool write_endgame_database(
+		const string& path,
+		const BoardGeometry& geometry,
+		const vector<uint8_t>& table) {
+	EndgameDatabaseHeader header;
+	std::memcpy(header.magic, DB_MAGIC, sizeof(header.magic));
+	header.version = DB_VERSION;
+	header.side = geometry.side;
+	header.n_entries = size(table);
+	header.reserved = 0;
+	
+	ofstream out(path, ios::binary | ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(table.data()), size(table));
+	return static_cast<bool>(out);
+}
+
+void build_database(int side, string path) {
+	auto start = std::chrono::steady_clock::now();
+	BoardGeometry geometry(side);
+	uint32_t n_reachable;
+	vector<uint8_t> table = build_endgame_table(geometry, n_reachable);
+	if (!write_endgame_database(path, geometry, table)) {
+		cerr << "Could not write database " << path << "." << endl;
+		return;
+	}
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+	
+	static const char* value_names[] = {"unreachable", "win", "loss", "draw"};
+	cout << "Wrote " << path << "\n"
+	     << "Board " << side << "x" << side
+		 << ", " << n_reachable << " reachable positions"
+		 << ", " << size(table) << " entries.\n"
+		 << "Empty board is a " << value_names[db_value(table[0])]
+		 << " in " << db_distance(table[0]) << " moves.\n"
+		 << "Solved in " << elapsed.count() << " s."
+		 << endl;
+}
+
+string default_database_path(int side) {
+	if (side == 3) {
+		return "tictactoe.db";
+	}
+	stringstream ss;
+	ss << "tictactoe_" << side << "x" << side << ".db";
+	return ss.str();
+}
+
+shared_ptr<const EndgameDatabase> shared_endgame_database() {
+	static shared_ptr<const EndgameDatabase> db = [] {
+		const char* env_path = getenv("TICTACTOE_DB");
+		shared_ptr<const EndgameDatabase> loaded = EndgameDatabase::open(
+			env_path ? env_path : default_database_path(3));
+		if (loaded && loaded->side() != 3) {
+			cerr << "Database is for a " << loaded->side() << "x"
+			     << loaded->side() << " board, not 3x3." << endl;
+			loaded.reset();
+		}
+		return loaded;
+	}();
+	return db;
+}
+
+
+shared_ptr<const EndgameDatabase> EndgameDatabase::open(const string& path) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		cerr << "Could not open database " << path << "." << endl;
+		return nullptr;
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+			static_cast<size_t>(st.st_size) < sizeof(EndgameDatabaseHeader)) {
+		cerr << "Database " << path << " is truncated." << endl;
+		close(fd);
+		return nullptr;
+	}
+	
+	void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		cerr << "Could not map database " << path << "." << endl;
+		return nullptr;
+	}
+	
+	shared_ptr<EndgameDatabase> db(new EndgameDatabase());
+	db->mapping = mapping;
+	db->mapping_size = st.st_size;
+	db->header = static_cast<const EndgameDatabaseHeader*>(mapping);
+	db->entries = static_cast<const uint8_t*>(mapping) + sizeof(EndgameDatabaseHeader);
+	
+	const EndgameDatabaseHeader* h = db->header;
+	uint64_t expected_entries = 1;
+	for (uint32_t i = 0; i < h->side*h->side && h->side <= DB_MAX_SIDE; i++) {
+		expected_entries *= 3;
+	}
+	if (std::memcmp(h->magic, DB_MAGIC, sizeof(DB_MAGIC)) != 0 ||
+			h->version != DB_VERSION ||
+			h->side < 2 || h->side > DB_MAX_SIDE ||
+			h->n_entries != expected_entries ||
+			db->mapping_size < sizeof(EndgameDatabaseHeader) + h->n_entries) {
+		cerr << "Database " << path << " is not a valid endgame database." << endl;
+		return nullptr;
+	}
+	
+	return db;
+}
+
+EndgameDatabase::~EndgameDatabase() {
+	if (mapping) {
+		munmap(mapping, mapping_size);
+	}
+}
+
+
+shared_ptr<SharedPositionCache> shared_position_cache() {
+	static shared_ptr<SharedPositionCache> cache =
+		shared_cache_name.empty() ? nullptr :
+		SharedPositionCache::open(shared_cache_name);
+	return cache;
+}
+
+
+shared_ptr<SharedPositionCache> SharedPositionCache::open(const string& name) {
+	// Segment names are a slash followed by a name without one.
+	string segment = name[0] == '/' ? name : "/" + name;
+	int fd = shm_open(segment.c_str(), O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		cerr << "Could not open shared cache " << name << "." << endl;
+		return nullptr;
+	}
+	
+	// A new segment is grown with zeros, so every slot starts free.
+	size_t size = HEADER_BYTES + N_SLOTS*sizeof(SharedCacheEntry);
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+			(static_cast<size_t>(st.st_size) < size && ftruncate(fd, size) != 0)) {
+		cerr << "Could not size shared cache " << name << "." << endl;
+		close(fd);
+		return nullptr;
+	}
+	void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		cerr << "Could not map shared cache " << name << "." << endl;
+		return nullptr;
+	}
+	
+	shared_ptr<SharedPositionCache> cache(new SharedPositionCache());
+	cache->mapping = mapping;
+	cache->mapping_size = size;
+	cache->header = static_cast<SharedCacheHeader*>(mapping);
+	cache->entries = reinterpret_cast<SharedCacheEntry*>(
+		static_cast<char*>(mapping) + HEADER_BYTES);
+	
+	// The first process to map the segment writes the header, the rest wait
+	// up to a second for it.
+	SharedCacheHeader* h = cache->header;
+	uint32_t state = 0;
+	if (h->state.compare_exchange_strong(state, 1)) {
+		std::memcpy(h->magic, SHARED_CACHE_MAGIC, sizeof(SHARED_CACHE_MAGIC));
+		h->version = SHARED_CACHE_VERSION;
+		h->n_slots = N_SLOTS;
+		h->state.store(2, std::memory_order_release);
+	}
+	for (int i = 0; i < 1000 && h->state.load(std::memory_order_acquire) != 2; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	if (h->state.load(std::memory_order_acquire) != 2 ||
+			std::memcmp(h->magic, SHARED_CACHE_MAGIC, sizeof(SHARED_CACHE_MAGIC)) != 0 ||
+			h->version != SHARED_CACHE_VERSION ||
+			h->n_slots != N_SLOTS) {
+		cerr << "Shared cache " << name << " is not a valid position cache." << endl;
+		return nullptr;
+	}
+	
+	return cache;
+}
+
+SharedPositionCache::~SharedPositionCache() {
+	if (mapping) {
+		munmap(mapping, mapping_size);
+	}
+}
+
+SharedCacheEntry* SharedPositionCache::find(uint32_t code, bool claim) const {
+	uint32_t key = code + 1;
+	uint32_t slot = (key*2654435761u) >> (32 - SLOT_BITS);
+	for (int probe = 0; probe < MAX_PROBES; probe++) {
+		SharedCacheEntry& entry = entries[slot];
+		uint32_t found = entry.key.load(std::memory_order_acquire);
+		if (found == 0 && claim) {
+			// On failure found is the key another writer claimed the slot for.
+			if (entry.key.compare_exchange_strong(found, key)) {
+				return &entry;
+			}
+		}
+		if (found == key) {
+			return &entry;
+		} else if (found == 0) {
+			return nullptr;
+		}
+		slot = (slot + 1) & (N_SLOTS - 1);
+	}
+	return nullptr;
+}
+
+uint64_t SharedPositionCache::monotonic_milliseconds() {
+	// Never 0, which marks an unlocked entry.
+	return 1 + std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool SharedPositionCache::read(uint32_t code, RolloutTotals& totals) const {
+	SharedCacheEntry* entry = find(code, false);
+	if (!entry) {
+		return false;
+	}
+	
+	uint32_t before = entry->sequence.load(std::memory_order_acquire);
+	if (before & 1) {
+		return false;
+	}
+	array<uint32_t, 9> samples;
+	array<uint64_t, 9> wins, ties;
+	for (int pos = 0; pos < 9; pos++) {
+		samples[pos] = entry->samples[pos].load(std::memory_order_relaxed);
+		wins[pos] = entry->wins[pos].load(std::memory_order_relaxed);
+		ties[pos] = entry->ties[pos].load(std::memory_order_relaxed);
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (entry->sequence.load(std::memory_order_relaxed) != before) {
+		return false;
+	}
+	
+	for (int pos = 0; pos < 9; pos++) {
+		totals.samples[pos] += samples[pos];
+		totals.wins[pos] += wins[pos] / SHARED_CACHE_ONE;
+		totals.ties[pos] += ties[pos] / SHARED_CACHE_ONE;
+	}
+	return true;
+}
+
+void SharedPositionCache::add(uint32_t code, const RolloutTotals& totals) {
+	SharedCacheEntry* entry = find(code, true);
+	if (!entry) {
+		return;
+	}
+	
+	uint64_t now = monotonic_milliseconds();
+	uint64_t locked_at = 0;
+	bool stale = false;
+	if (!entry->locked_at.compare_exchange_strong(
+			locked_at, now, std::memory_order_acquire)) {
+		// On failure locked_at is when the current holder locked the entry.
+		if (now < locked_at + STALE_MILLISECONDS ||
+				!entry->locked_at.compare_exchange_strong(
+					locked_at, now, std::memory_order_acquire)) {
+			return;
+		}
+		stale = true;
+	}
+	
+	// A dead writer may have left the sequence odd already.
+	uint32_t odd = entry->sequence.load(std::memory_order_relaxed) | 1;
+	entry->sequence.store(odd, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	
+	for (int pos = 0; pos < 9; pos++) {
+		if (stale) {
+			// Whatever the dead writer added of its totals is dropped.
+			entry->samples[pos].store(0, std::memory_order_relaxed);
+			entry->wins[pos].store(0, std::memory_order_relaxed);
+			entry->ties[pos].store(0, std::memory_order_relaxed);
+		}
+		uint32_t n = entry->samples[pos].load(std::memory_order_relaxed);
+		if (totals.samples[pos] == 0 || n + totals.samples[pos] > MAX_SAMPLES) {
+			continue;
+		}
+		entry->samples[pos].store(n + totals.samples[pos], std::memory_order_relaxed);
+		entry->wins[pos].fetch_add(
+			std::llround(totals.wins[pos]*SHARED_CACHE_ONE), std::memory_order_relaxed);
+		entry->ties[pos].fetch_add(
+			std::llround(totals.ties[pos]*SHARED_CACHE_ONE), std::memory_order_relaxed);
+	}
+	entry->sequence.store(odd + 1, std::memory_order_release);
+	entry->locked_at.store(0, std::memory_order_release);
+}
+
+
+void SelfPlayTrainer::train(int n_games, unsigned int seed) {
+	default_random_engine generator(seed);
+	std::uniform_real_distribution<double> explore(0.0, 1.0);
+	array<uint32_t, 9> afterstates;
+	
+	for (int game = 0; game < n_games; game++) {
+		Board b;
+		int n_moves = 0;
+		while (b.is_playing()) {
+			int player = b.next_player();
+			uint32_t code = b.position_code();
+			MoveList moves = b.valid_moves(player);
+			
+			Move chosen = moves[0];
+			if (explore(generator) < epsilon) {
+				uniform_int_distribution<int> idx_dist(0, size(moves) - 1);
+				chosen = moves[idx_dist(generator)];
+			} else {
+				float best_value = -1;
+				for (Move m : moves) {
+					float v = values[code + player*POSITION_POWERS[m.position]]
+						.load(std::memory_order_relaxed);
+					if (v > best_value) {
+						best_value = v;
+						chosen = m;
+					}
+				}
+			}
+			
+			b.apply_move(chosen);
+			afterstates[n_moves++] = b.position_code();
+		}
+		
+		// Sweep back from the result, each afterstate moves toward the
+		// updated value of the same player's next afterstate.
+		array<float, 2> targets;
+		for (int idx = 0; idx < 2; idx++) {
+			targets[idx] = b.is_tie() ? 0.5f :
+				b.winning_player() == idx + 1 ? 1.0f : 0.0f;
+		}
+		for (int t = n_moves - 1; t >= 0; t--) {
+			atomic<float>& v = values[afterstates[t]];
+			float current = v.load(std::memory_order_relaxed);
+			float updated = current + alpha*(targets[t % 2] - current);
+			v.store(updated, std::memory_order_relaxed);
+			targets[t % 2] = updated;
+		}
+	}
+}
+
+LearnedValues SelfPlayTrainer::snapshot() const {
+	LearnedValues learned;
+	for (uint32_t i = 0; i < N_POSITION_CODES; i++) {
+		learned.values[i] = values[i].load(std::memory_order_relaxed);
+	}
+	return learned;
+}
+
+shared_ptr<const LearnedValues> LearnedValues::load(const string& path) {
+	ifstream in(path, ios::binary);
+	LearnedValuesHeader header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+		cerr << "Could not read learned values " << path << "." << endl;
+		return nullptr;
+	}
+	if (std::memcmp(header.magic, LEARNED_MAGIC, sizeof(LEARNED_MAGIC)) != 0 ||
+			header.version != LEARNED_VERSION ||
+			header.n_entries != N_POSITION_CODES) {
+		cerr << "File " << path << " is not a learned values file." << endl;
+		return nullptr;
+	}
+	
+	vector<uint16_t> fixed(N_POSITION_CODES);
+	if (!in.read(reinterpret_cast<char*>(fixed.data()),
+			N_POSITION_CODES*sizeof(uint16_t))) {
+		cerr << "Learned values " << path << " are truncated." << endl;
+		return nullptr;
+	}
+	
+	shared_ptr<LearnedValues> learned = make_shared<LearnedValues>();
+	for (uint32_t i = 0; i < N_POSITION_CODES; i++) {
+		learned->values[i] = fixed[i] / 65535.0f;
+	}
+	return learned;
+}
+
+bool LearnedValues::save(const string& path) const {
+	LearnedValuesHeader header;
+	std::memcpy(header.magic, LEARNED_MAGIC, sizeof(header.magic));
+	header.version = LEARNED_VERSION;
+	header.n_entries = N_POSITION_CODES;
+	
+	vector<uint16_t> fixed(N_POSITION_CODES);
+	for (uint32_t i = 0; i < N_POSITION_CODES; i++) {
+		float v = std::min(std::max(values[i], 0.0f), 1.0f);
+		fixed[i] = static_cast<uint16_t>(v*65535.0f + 0.5f);
+	}
+	
+	ofstream out(path, ios::binary | ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(fixed.data()),
+		N_POSITION_CODES*sizeof(uint16_t));
+	return static_cast<bool>(out);
+}
+
+void GameLogStats::merge(const GameLogStats& other) {
+	n_games += other.n_games;
+	n_skipped += other.n_skipped;
+	for (int r = 0; r < 3; r++) {
+		results[r] += other.results[r];
+	}
+	for (int pos = 0; pos < MAX_POSITIONS; pos++) {
+		for (int r = 0; r < 3; r++) {
+			first_move_results[pos][r] += other.first_move_results[pos][r];
+		}
+	}
+	for (size_t i = 0; i < size(openings); i++) {
+		openings[i] += other.openings[i];
+	}
+	for (int n = 0; n <= MAX_POSITIONS; n++) {
+		lengths[n] += other.lengths[n];
+	}
+}
+
+void GameLogStats::print(ostream& os) const {
+	auto percent = [](uint64_t count, uint64_t total) {
+		return total == 0 ? 0.0 : static_cast<double>(count) / total * 100;
+	};
+	
+	uint64_t total_moves = 0;
+	for (int n = 0; n <= MAX_POSITIONS; n++) {
+		total_moves += n*lengths[n];
+	}
+	os << "Games " << n_games << ", skipped lines " << n_skipped << "\n\n"
+	   << "Wins (%) Losses (%) Ties (%) Mean Moves\n"
+	   << std::setw(8) << percent(results[0], n_games) << " "
+	   << std::setw(10) << percent(results[1], n_games) << " "
+	   << std::setw(8) << percent(results[2], n_games) << " "
+	   << std::setw(10) << (n_games ? static_cast<double>(total_moves) / n_games : 0)
+	   << "\n\n";
+	
+	os << "First Move      Games Share (%) Wins (%) Losses (%) Ties (%)\n";
+	for (int pos = 0; pos < MAX_POSITIONS; pos++) {
+		const ResultCounts& counts = first_move_results[pos];
+		uint64_t games = counts[0] + counts[1] + counts[2];
+		if (games == 0) {
+			continue;
+		}
+		os << std::setw(10) << pos << " "
+		   << std::setw(10) << games << " "
+		   << std::setw(9) << percent(games, n_games) << " "
+		   << std::setw(8) << percent(counts[0], games) << " "
+		   << std::setw(10) << percent(counts[1], games) << " "
+		   << std::setw(8) << percent(counts[2], games) << "\n";
+	}
+	
+	// The ten most common first two moves.
+	vector<int> opening_order;
+	for (size_t i = 0; i < size(openings); i++) {
+		if (openings[i] > 0) {
+			opening_order.push_back(i);
+		}
+	}
+	size_t n_shown = std::min<size_t>(10, size(opening_order));
+	std::partial_sort(opening_order.begin(), opening_order.begin() + n_shown,
+		opening_order.end(), [this](int a, int b) {
+			return openings[a] > openings[b];
+		});
+	os << "\nOpening         Games Share (%)\n";
+	for (size_t i = 0; i < n_shown; i++) {
+		int opening = opening_order[i];
+		stringstream moves;
+		moves << "1@" << opening / MAX_POSITIONS
+		      << " 2@" << opening % MAX_POSITIONS;
+		os << std::setw(10) << moves.str() << " "
+		   << std::setw(10) << openings[opening] << " "
+		   << std::setw(9) << percent(openings[opening], n_games) << "\n";
+	}
+	
+	os << "\nMoves           Games Share (%)\n";
+	for (int n = 0; n <= MAX_POSITIONS; n++) {
+		if (lengths[n] > 0) {
+			os << std::setw(10) << n << " "
+			   << std::setw(10) << lengths[n] << " "
+			   << std::setw(9) << percent(lengths[n], n_games) << "\n";
+		}
+	}
+	os << std::flush;
+}
+
+// Maps each log and parses it in newline aligned chunks on the engine
+// pool, each chunk into stats of its own that are merged at the end.
+void log_stats(const vector<string>& paths) {
+	static const size_t CHUNK_BYTES = 4 << 20;
+	auto start = std::chrono::steady_clock::now();
+	
+	struct Mapping {
+		void* data;
+		size_t size;
+	};
+	vector<Mapping> mappings;
+	vector<string_view> chunks;
+	for (const string& path : paths) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			cerr << "Could not open log " << path << "." << endl;
+			if (fd >= 0) {
+				close(fd);
+			}
+			continue;
+		}
+		size_t file_size = st.st_size;
+		if (file_size == 0) {
+			close(fd);
+			continue;
+		}
+		
+		void* data = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) {
+			cerr << "Could not map log " << path << "." << endl;
+			continue;
+		}
+		madvise(data, file_size, MADV_SEQUENTIAL);
+		mappings.push_back({data, file_size});
+		
+		string_view text(static_cast<const char*>(data), file_size);
+		while (!text.empty()) {
+			size_t end = text.size() <= CHUNK_BYTES ?
+				string_view::npos : text.find('\n', CHUNK_BYTES);
+			end = end == string_view::npos ? text.size() : end + 1;
+			chunks.push_back(text.substr(0, end));
+			text.remove_prefix(end);
+		}
+	}
+	
+	vector<GameLogStats> chunk_stats(size(chunks));
+	{
+		TaskGroup group(engine_pool());
+		for (size_t c = 0; c < size(chunks); c++) {
+			group.run([&chunks, &chunk_stats, c] {
+				chunk_stats[c].add_text(chunks[c]);
+			});
+		}
+	}
+	
+	GameLogStats stats;
+	uint64_t n_bytes = 0;
+	for (const GameLogStats& chunk : chunk_stats) {
+		stats.merge(chunk);
+	}
+	for (const Mapping& mapping : mappings) {
+		n_bytes += mapping.size;
+		munmap(mapping.data, mapping.size);
+	}
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+	
+	stats.print(cout);
+	cout << "\nRead " << stats.games() << " games (" << n_bytes / 1e6
+	     << " MB) in " << elapsed.count() << " s ("
+		 << stats.games() / elapsed.count() << " games/s)." << endl;
+}
+
+std::optional<string> Session::LineAwaiter::await_resume() {
+	size_t end = session.input.find('\n');
+	if (end == string::npos) {
+		return std::nullopt;
+	}
+	string line = session.input.substr(0, end);
+	session.input.erase(0, end + 1);
+	if (!line.empty() && line.back() == '\r') {
+		line.pop_back();
+	}
+	return line;
+}
+
+void Session::EngineAwaiter::await_suspend(std::coroutine_handle<> h) {
+	session.waiting = h;
+	session.awaiting_engine = true;
+	Session* s = &session;
+	Player* p = engine;
+	Board b = board;
+	engine_pool().submit([s, p, b] {
+		s->host.complete(s, p->next_move(b));
+	});
+}
+
+void Session::reply(string_view text) {
+	if (closed) {
+		return;
+	}
+	bool was_empty = output.empty();
+	output.append(text);
+	if (!was_empty) {
+		return;
+	}
+	
+	ssize_t written = ::send(fd, output.data(), size(output), MSG_NOSIGNAL);
+	if (written > 0) {
+		output.erase(0, written);
+	} else if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		output.clear();
+		return;
+	}
+	if (!output.empty()) {
+		host.watch_output(*this, true);
+	}
+}
+
+// Plays games with one client until it quits or goes away.
+SessionTask play_sessions(Session& session, const PlayerSpec& engine_spec) {
+	while (true) {
+		std::optional<string> line = co_await session.read_line();
+		if (!line || *line == "quit") {
+			co_return;
+		}
+		int side = *line == "play 1" ? 1 : *line == "play 2" ? 2 : 0;
+		if (side == 0) {
+			session.reply("error expected play 1, play 2 or quit\n");
+			continue;
+		}
+		
+		int engine_side = other_player(side);
+		unique_ptr<Player> engine(find_player_by_name(engine_spec, engine_side));
+		Board board;
+		GameRecord action_log;
+		session.reply("start " + std::to_string(side) + "\n");
+		
+		while (board.is_playing()) {
+			Move move;
+			if (board.next_player() == engine_side) {
+				move = co_await session.engine_next_move(engine.get(), board);
+				stringstream reply;
+				reply << "move " << move << "\n";
+				session.reply(reply.str());
+			} else {
+				line = co_await session.read_line();
+				if (!line || *line == "quit") {
+					co_return;
+				}
+				int position = -1;
+				stringstream(*line) >> position;
+				if (position < 0 || position > 8 ||
+						!(board.empty_mask() >> position & 1)) {
+					session.reply("illegal " + *line + "\n");
+					continue;
+				}
+				move = Move(position, side);
+			}
+			board.apply_move(move);
+			action_log.push_back(move);
+		}
+		
+		int winner = board.is_won() ? board.winning_player() : TIE;
+		stringstream reply;
+		reply << "end " << action_log << " "
+		      << (winner == 1 ? "W" : winner == 2 ? "L" : "T") << "\n";
+		session.reply(reply.str());
+	}
+}
+
+SessionHost::SessionHost(const PlayerSpec& engine) :
+		engine_spec(engine),
+		epoll_fd(epoll_create1(0)),
+		event_fd(eventfd(0, EFD_NONBLOCK)),
+		listen_fd(-1) {
+	epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.fd = event_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &event);
+}
+
+SessionHost::~SessionHost() {
+	sessions.clear();
+	if (listen_fd >= 0) {
+		close(listen_fd);
+	}
+	close(event_fd);
+	close(epoll_fd);
+}
+
+bool SessionHost::listen_on(const string& path) {
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if (size(path) >= sizeof(address.sun_path)) {
+		cerr << "Socket path " << path << " is too long." << endl;
+		return false;
+	}
+	std::memcpy(address.sun_path, path.c_str(), size(path) + 1);
+	
+	unlink(path.c_str());
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (listen_fd < 0 ||
+			bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+			listen(listen_fd, SOMAXCONN) != 0) {
+		cerr << "Could not listen on " << path << "." << endl;
+		if (listen_fd >= 0) {
+			close(listen_fd);
+			listen_fd = -1;
+		}
+		return false;
+	}
+	
+	epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.fd = listen_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+	cout << "Serving " << engine_spec.text << " on " << path << endl;
+	return true;
+}
+
+void SessionHost::attach(int fd) {
+	Session* session = new Session(*this, fd);
+	sessions[fd].reset(session);
+	
+	epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	session->task = play_sessions(*session, engine_spec);
+}
+
+void SessionHost::run() {
+	array<epoll_event, 64> events;
+	while (listen_fd >= 0 || !sessions.empty()) {
+		int n_events = epoll_wait(epoll_fd, events.data(), size(events), -1);
+		for (int i = 0; i < n_events; i++) {
+			int fd = events[i].data.fd;
+			if (fd == listen_fd) {
+				accept_clients();
+				continue;
+			} else if (fd == event_fd) {
+				uint64_t count;
+				while (read(event_fd, &count, sizeof(count)) > 0) {}
+				vector<std::pair<Session*, Move>> ready;
+				{
+					std::lock_guard<std::mutex> lock(completed_mutex);
+					ready.swap(completed);
+				}
+				for (auto [session, move] : ready) {
+					session->engine_move = move;
+					session->awaiting_engine = false;
+					resume(*session);
+				}
+				continue;
+			}
+			
+			// Sessions can be freed by an earlier event in this batch.
+			auto found = sessions.find(fd);
+			if (found == sessions.end()) {
+				continue;
+			}
+			Session& session = *found->second;
+			if (events[i].events & EPOLLOUT) {
+				write_client(session);
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				read_client(session);
+			}
+		}
+	}
+}
+
+void SessionHost::complete(Session* session, Move move) {
+	{
+		std::lock_guard<std::mutex> lock(completed_mutex);
+		completed.push_back({session, move});
+	}
+	uint64_t one = 1;
+	if (write(event_fd, &one, sizeof(one)) < 0) {
+		cerr << "Could not signal the session host." << endl;
+	}
+}
+
+void SessionHost::watch_output(Session& session, bool want_output) {
+	epoll_event event{};
+	event.events = want_output ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	event.data.fd = session.fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session.fd, &event);
+}
+
+void SessionHost::accept_clients() {
+	while (true) {
+		int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+		if (fd < 0) {
+			return;
+		}
+		attach(fd);
+	}
+}
+
+void SessionHost::read_client(Session& session) {
+	char buffer[4096];
+	while (true) {
+		ssize_t n = read(session.fd, buffer, sizeof(buffer));
+		if (n > 0) {
+			session.input.append(buffer, n);
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else {
+			close_client(session);
+			break;
+		}
+	}
+	if (session.input.find('\n') == string::npos &&
+			size(session.input) > MAX_LINE) {
+		close_client(session);
+	}
+	if (!session.awaiting_engine &&
+			(session.closed || session.input.find('\n') != string::npos)) {
+		resume(session);
+	}
+}
+
+void SessionHost::write_client(Session& session) {
+	ssize_t written = ::send(session.fd, session.output.data(),
+		size(session.output), MSG_NOSIGNAL);
+	if (written > 0) {
+		session.output.erase(0, written);
+	} else if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		close_client(session);
+	}
+	if (session.output.empty()) {
+		watch_output(session, false);
+	}
 }
 
+// The session lives on until its coroutine finishes, which may have to wait
+// for a move from the engine pool.
+void SessionHost::close_client(Session& session) {
+	if (!session.closed) {
+		session.closed = true;
+		session.output.clear();
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session.fd, nullptr);
+	}
+}
 
-void test() {
-	test_board_status();
-	test_board_moves();
-	test_random_moves();
-	test_random_game();
+void SessionHost::resume(Session& session) {
+	if (session.waiting) {
+		std::coroutine_handle<> h = session.waiting;
+		session.waiting = nullptr;
+		h.resume();
+	}
+	if (session.task.handle.done()) {
+		sessions.erase(session.fd);
+	}
 }
 
-void score_players( 
-		string player_one_name, 
-		string player_two_name,
-		int n_games=100) {
-	// Metrics from player_one's perspective.
-	int wins = 0;
-	int losses = 0;
-	int ties = 0;
+void learn_values(int n_games, int n_threads, string path) {
+	auto start = std::chrono::steady_clock::now();
+	SelfPlayTrainer trainer;
 	
-	vector<vector<Move>> game_logs(n_games);
-	
-	for (int i = 0; i < n_games; i++) {
-		unique_ptr<Player> player_one(find_player_by_name(
-				player_one_name, 1));
-		unique_ptr<Player> player_two(find_player_by_name(
-				player_two_name, 2));
-				
-		Tictactoe game(player_one.get(), player_two.get());
-		game.play();
-		
-		game_logs[i] = game.action_log;
-		cout << game_logs[i] << " ";
-		
-		if (game.board.winning_player() == 1) {
-			wins++;
-			cout << "W";
-		} else if (game.board.winning_player() == 2) {
-			losses++;
-			cout << "L";
-		} else if (game.board.is_tie()) {
-			ties++;
-			cout << "T";
-		}
-		
-		cout << endl;
+	vector<thread> workers;
+	for (int t = 0; t < n_threads; t++) {
+		int games = n_games / n_threads + (t < n_games % n_threads ? 1 : 0);
+		unsigned int seed = fresh_seed();
+		workers.emplace_back([&trainer, games, seed] {
+			trainer.train(games, seed);
+		});
 	}
-	
-	double win_percent = static_cast<double>(wins) / n_games * 100;
-	double loss_percent = static_cast<double>(losses) / n_games * 100;
-	double tie_percent = static_cast<double>(ties) / n_games * 100;
-	double mean_moves = 0;
-	for (auto log : game_logs) {
-		mean_moves += size(log);
+	for (thread& worker : workers) {
+		worker.join();
 	}
-	mean_moves /= n_games;
 	
+	LearnedValues learned = trainer.snapshot();
+	if (!learned.save(path)) {
+		cerr << "Could not write learned values " << path << "." << endl;
+		return;
+	}
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
 	
-	cout << "Wins (%) "
-	     << "Losses (%) "
-		 << "Ties (%) "
-		 << "Mean Moves\n"
-		 << std::setw(8) << win_percent  << " "
-		 << std::setw(10) << loss_percent << " "
-		 << std::setw(8) << tie_percent  << " "
-		 << std::setw(10) << mean_moves
+	cout << "Wrote " << path << "\n"
+	     << n_games << " self-play games on " << n_threads << " threads"
+		 << " in " << elapsed.count() << " s"
+		 << " (" << n_games / elapsed.count() << " games/s)."
 		 << endl;
 }
 
-
-Player* find_player_by_name(string player_name, int player) {
-	if (player_name == "random") {
-		return new RandomPlayer(player);
-	} else if (player_name == "one_step_ahead") {
-		return new OneStepAheadPlayer(player);
-	} else if (player_name == "one_step_ahead_mcst") {
-		return new OneStepAheadMCSTPlayer(player, 10000);
-	} else {
-		return 0; // If valid player not found.
-	}
+shared_ptr<const LearnedValues> shared_learned_values() {
+	static shared_ptr<const LearnedValues> learned = [] {
+		const char* env_path = getenv("TICTACTOE_LEARNED");
+		return LearnedValues::load(env_path ? env_path : DEFAULT_LEARNED_PATH);
+	}();
+	return learned;
 }
 
 
-void test_board_status() {
-	static const vector<vector<int>> test_boards = {
-			{0, 0, 0, 0, 0, 0, 0, 0, 0},
-			{1, 1, 1, 0, 0, 0, 0, 0, 0},
-			{0, 0, 0, 1, 1, 1, 0, 0, 0},
-			{0, 0, 0, 0, 0, 0, 1, 1, 1},
-			{1, 0, 0, 1, 0, 0, 1, 0, 0},
-			{0, 1, 0, 0, 1, 0, 0, 1, 0},
-			{0, 0, 1, 0, 0, 1, 0, 0, 1},
-			{1, 0, 0, 0, 1, 0, 0, 0, 1},
-			{0, 0, 1, 0, 1, 0, 1, 0, 0},
-			{2, 2, 2, 0, 0, 0, 0, 0, 0},
-			{0, 0, 0, 2, 2, 2, 0, 0, 0},
-			{0, 0, 0, 0, 0, 0, 2, 2, 2},
-			{2, 0, 0, 2, 0, 0, 2, 0, 0},
-			{0, 2, 0, 0, 2, 0, 0, 2, 0},
-			{0, 0, 2, 0, 0, 2, 0, 0, 2},
-			{2, 0, 0, 0, 2, 0, 0, 0, 2},
-			{0, 0, 2, 0, 2, 0, 2, 0, 0},
-			{1, 2, 2, 2, 1, 1, 1, 2, 2}
-		};
-	
-	for (auto tb : test_boards) {
-		Board b(tb);
-		cout << b << endl;
+// Index of the pool worker running on this thread, -1 for other threads.
+static thread_local int current_worker_index = -1;
+
+WorkStealingPool::WorkStealingPool(int n_threads) :
+		n_workers(n_threads),
+		n_queued(0),
+		next_queue(0),
+		stopping(false) {
+	for (int i = 0; i < n_threads; i++) {
+		queues.emplace_back(new WorkerQueue());
+	}
+	for (int i = 0; i < n_threads; i++) {
+		workers.emplace_back(&WorkStealingPool::worker_loop, this, i);
 	}
 }
 
-
-void test_board_moves() {
-	Board b1, b2;
-	static const vector<int> player_seq1 = {1, 2, 1, 2, 1, 2, 1, 2, 1};
-	static const vector<int> player_seq2 = {2, 1, 2, 1, 2, 1, 2, 1, 2};
-	static const vector<int> position_seq = {1, 0, 2, 4, 3, 5, 7, 6, 8};
-	
-	cout << b1;
-	for (int i = 0; i < 9; i++) {
-		Move m(position_seq[i], player_seq1[i]);
-		b1.apply_move(m);
-		cout << b1;
+WorkStealingPool::~WorkStealingPool() {
+	{
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		stopping = true;
 	}
-	
-	cout << b2;
-	for (int i = 0; i < 9; i++) {
-		Move m(position_seq[i], player_seq2[i]);
-		b2.apply_move(m);
-		cout << b2;
+	wake.notify_all();
+	for (thread& worker : workers) {
+		worker.join();
 	}
 }
 
-void test_random_moves() {
-	Board b;
-	RandomPlayer p1(1);
-	RandomPlayer p2(2);
-	
-	cout << b;
-	for (int i = 0; i < 4; i++) {
-		Move m = p1.next_move(b);
-		cout << m << endl;
-		b.apply_move(m);
-		cout << b;
-		m = p2.next_move(b);
-		cout << m << endl;
-		b.apply_move(m);
-		cout << b;
+void WorkStealingPool::submit(task_type task, const TaskGroup* group) {
+	// Workers push to their own queue, other threads spread tasks around.
+	int index = current_worker_index >= 0 ?
+		current_worker_index : next_queue++ % queues.size();
+	{
+		std::lock_guard<std::mutex> lock(queues[index]->mutex);
+		queues[index]->tasks.push_back({std::move(task), group});
 	}
+	n_queued++;
+	std::lock_guard<std::mutex> lock(wake_mutex);
+	wake.notify_one();
 }
 
-void test_random_game() {
-	RandomPlayer p1(1), p2(2);
-	Tictactoe(&p1, &p2).play();
+bool WorkStealingPool::run_pending_task(const TaskGroup* group) {
+	task_type task;
+	if ((current_worker_index >= 0 && pop_task(current_worker_index, group, task)) ||
+			steal_task(current_worker_index, group, task)) {
+		task();
+		return true;
+	}
+	return false;
 }
 
+bool WorkStealingPool::pop_task(
+		int queue_index,
+		const TaskGroup* group,
+		task_type& task) {
+	WorkerQueue& queue = *queues[queue_index];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	for (auto it = queue.tasks.rbegin(); it != queue.tasks.rend(); ++it) {
+		if (!group || it->group == group) {
+			task = std::move(it->task);
+			queue.tasks.erase(std::next(it).base());
+			n_queued--;
+			return true;
+		}
+	}
+	return false;
+}
 
-void CLIHandler::print_usage() {
-	cout << "\nUsage: ./tictactoe.exe COMMAND COMMAND_ARGS\n\n"
-	     << "COMMAND       One of the following:\n"
-		 << "  test        Runs a series of tests of game engine features.\n"
-		 << "  random      Plays game between to players randomly choosing moves.\n"
-		 << "  score       Plays a game n times between two players and returns score by wins, losses, and ties by player one.\n\n"
-		 << "COMMAND_ARGS  Arguments to each command.\n"
-		 << "  test        None.\n"
-		 << "  random      None.\n"
-		 << "  score       n_games, player_one_name, player_two_name.\n\n"
-		 << endl;
+bool WorkStealingPool::steal_task(
+		int thief_index,
+		const TaskGroup* group,
+		task_type& task) {
+	int n_queues = size();
+	int start = thief_index >= 0 ? thief_index + 1 : 0;
+	for (int i = 0; i < n_queues; i++) {
+		int victim = (start + i) % n_queues;
+		if (victim == thief_index) {
+			continue;
+		}
+		WorkerQueue& queue = *queues[victim];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		for (auto it = queue.tasks.begin(); it != queue.tasks.end(); ++it) {
+			if (!group || it->group == group) {
+				task = std::move(it->task);
+				queue.tasks.erase(it);
+				n_queued--;
+				return true;
+			}
+		}
+	}
+	return false;
 }
 
-void CLIHandler::print_usage_score() {
-	cout << "\nUsage: ./tictactoe.exe score n_games player_one_name player_two_name\n\n"
-	     << "  n_games          Number of games to play.\n"
-		 << "  player_one_name  Name of player one, one of random, one_step_ahead.  This determines the players move choices.\n"
-		 << "  player_two_name  Name of player two, see player_one_name.\n\n"
-		 << endl;
+void WorkStealingPool::worker_loop(int index) {
+	current_worker_index = index;
+	for (;;) {
+		if (run_pending_task()) {
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(wake_mutex);
+		wake.wait(lock, [this] { return stopping || n_queued > 0; });
+		if (stopping) {
+			return;
+		}
+	}
 }
 
+WorkStealingPool& engine_pool() {
+	static WorkStealingPool pool(std::max(1,
+		static_cast<int>(thread::hardware_concurrency()) - 1));
+	return pool;
+}
 
-void Tictactoe::play() {
-	// If game has already been played. Do nothing.
-	if (!board.is_playing()) {
-		return;
-	}
+
+void ScoreMetrics::print_allocations(
+		ostream& os,
+		const string& player_one_name,
+		const string& player_two_name) const {
+	struct Row {
+		string label;
+		const AllocationTotals& totals;
+	};
+	const Row rows[] = {
+		{"per game", game_allocations},
+		{"per move " + player_one_name + " (one)", move_allocations[0]},
+		{"per move " + player_two_name + " (two)", move_allocations[1]}};
 	
-	for (; 
-			board.is_playing(); 
-			next_player_idx = other_player_index(next_player_idx)) {
-		Move m = players[next_player_idx]->next_move(board);
-		board.apply_move(m);
-		action_log.push_back(m);
-		//cout << *this << endl;
+	std::ios_base::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision(1);
+	os << std::fixed;
+	os << "Allocations" << std::setw(37) << "Count"
+	   << std::setw(12) << "Bytes"
+	   << std::setw(12) << "Max Count"
+	   << std::setw(12) << "Max Bytes" << "\n";
+	for (const Row& row : rows) {
+		double samples = std::max<uint64_t>(row.totals.samples, 1);
+		os << "  " << std::left << std::setw(36) << row.label << std::right
+		   << std::setw(10) << row.totals.count / samples
+		   << std::setw(12) << row.totals.bytes / samples
+		   << std::setw(12) << row.totals.max_count
+		   << std::setw(12) << row.totals.max_bytes << "\n";
 	}
+	os << "  " << std::left << std::setw(36) << "whole run" << std::right
+	   << std::setw(10) << global_allocations.count
+	   << std::setw(12) << global_allocations.bytes
+	   << endl;
+	os.flags(flags);
+	os.precision(precision);
 }
 
 
-ostream& operator<<(ostream& os, const Tictactoe& game) {
-	cout << game.board;
-	cout << "Moves: ";
-	for (Move m : game.action_log) {
-		cout << m << " ";
+void ScoreMetrics::print_latencies(
+		ostream& os,
+		const string& player_one_name,
+		const string& player_two_name) const {
+	auto print_row = [&os](const string& label, const LatencyHistogram& h) {
+		os << "  " << std::left << std::setw(36) << label << std::right
+		   << std::setw(10) << h.samples()
+		   << std::setw(10) << h.percentile(0.5) / 1e3
+		   << std::setw(10) << h.percentile(0.9) / 1e3
+		   << std::setw(10) << h.percentile(0.99) / 1e3
+		   << std::setw(10) << h.max() / 1e3 << "\n";
+	};
+	
+	std::ios_base::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision(1);
+	os << std::fixed;
+	os << "Move Latency (us)" << std::setw(31) << "Moves"
+	   << std::setw(10) << "p50"
+	   << std::setw(10) << "p90"
+	   << std::setw(10) << "p99"
+	   << std::setw(10) << "Max" << "\n";
+	print_row(player_one_name + " (one)", player_latencies[0]);
+	print_row(player_two_name + " (two)", player_latencies[1]);
+	for (size_t ply = 0; ply < size(ply_latencies); ply++) {
+		if (ply_latencies[ply].samples() > 0) {
+			print_row("ply " + std::to_string(ply) +
+				(ply % 2 == 0 ? " (one)" : " (two)"), ply_latencies[ply]);
+		}
 	}
-	cout << endl;
+	os << std::flush;
+	os.flags(flags);
+	os.precision(precision);
 }
 
+// Replaced global allocation functions, in every plain, array, aligned and
+// nothrow form, counting when --track-allocs is set.
+static inline void record_allocation(size_t size) {
+	global_allocations.count.fetch_add(1, std::memory_order_relaxed);
+	global_allocations.bytes.fetch_add(size, std::memory_order_relaxed);
+	for (AllocationCounter* counter = current_allocation_counter;
+			counter;
+			counter = counter->parent) {
+		counter->count.fetch_add(1, std::memory_order_relaxed);
+		counter->bytes.fetch_add(size, std::memory_order_relaxed);
+	}
+}
 
-ostream& operator<<(ostream& os, const Board& b) {
-	for (int i = 0; i < 3; i++) {
-		for (int j = 0; j < 3; j++) {
-			os << b.board[3*i + j]
-			   << (j == 2 ? "\n" : "|");
-		}
-		if (i < 2) {
-			os << std::string(5, '-')
-			   << endl;
-		}
+// Every replaced allocation function goes through these two.  They are kept
+// out of line so the compiler never sees malloc and free paired with new
+// and delete, which -Wmismatched-new-delete would flag though they match.
+__attribute__((noinline))
+static void* counted_allocate(size_t size, size_t alignment) noexcept {
+	if (alloc_tracking_enabled) {
+		record_allocation(size);
 	}
-	
-	if (b.is_won()) {
-		os << "Player " << b.winning_player() << " wins." << endl;
-	} else if (b.is_tie()) {
-		os << "Tie." << endl;
-	} else {
-		os << "Playing." << endl;
+	if (size == 0) {
+		size = 1;
 	}
-	
-	return os;
+	if (alignment <= alignof(std::max_align_t)) {
+		return std::malloc(size);
+	}
+	// aligned_alloc wants a multiple of the alignment.
+	return std::aligned_alloc(alignment, (size + alignment - 1) / alignment*alignment);
 }
 
-void Board::update_status() {
-	static const vector<int> players = {1, 2};
-	
-	bool player_won = false;
-	for (auto player : players) {
-		// Win by rows
-		for (int row = 0; row < 3; row++) {
-			player_won = player_won || 
-				(board[3*row] == player) &&
-				(board[3*row + 1] == player) &&
-				(board[3*row + 2] == player);
-		}
-		
-		// Win by columns
-		for (int column = 0; column < 3; column++) {
-			player_won = player_won ||
-				(board[column] == player) &&
-				(board[3 + column] == player) &&
-				(board[6 + column] == player);
-			
-		}
-		
-		// Win by diagonals
-		player_won = player_won ||
-			((board[0] == player) &&
-			 (board[3+1] == player) &&
-			 (board[6+2] == player)) ||
-			((board[2] == player) &&
-			 (board[3+1] == player) &&
-			 (board[6] == player));
+__attribute__((noinline))
+static void counted_free(void* p) noexcept {
+	std::free(p);
+}
 
-		if (player_won) {
-			status = player;
-			return;
+// Gives the new handler a chance to free memory before each retry, and
+// throws only once there is no handler, as the throwing forms must.
+static void* counted_allocate_or_throw(size_t size, size_t alignment) {
+	for (;;) {
+		void* p = counted_allocate(size, alignment);
+		if (p) {
+			return p;
 		}
-	}
-	
-	bool board_tied = true;
-	for (auto b : board) {
-		if (b == EMPTY) {
-			board_tied = false;
-			break;
+		std::new_handler handler = std::get_new_handler();
+		if (!handler) {
+			throw std::bad_alloc();
 		}
+		handler();
 	}
-	if (board_tied) {
-		status = TIE;
-		return;
-	}
-	
-	status = PLAYING;
 }
 
+void* operator new(size_t size) {
+	return counted_allocate_or_throw(size, 0);
+}
 
-ostream& operator<<(ostream& os, const Move& m) {
-	os << m.player << "@" << m.position;
-	return os;
+void* operator new[](size_t size) {
+	return counted_allocate_or_throw(size, 0);
 }
 
-ostream& operator<<(ostream& os, const vector<Move>& moves) {
-	for (int i = 0; i < size(moves)-1; i++) {
-		os << moves[i] << " ";
-	}
-	os << moves[size(moves)-1];
-	return os;
-}
\ No newline at end of file
+void* operator new(size_t size, std::align_val_t alignment) {
+	return counted_allocate_or_throw(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+	return counted_allocate_or_throw(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+	return counted_allocate(size, 0);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+	return counted_allocate(size, 0);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+	return counted_allocate(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+	return counted_allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept {
+	counted_free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	counted_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	counted_free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	counted_free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+	counted_free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+	counted_free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+	counted_free(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+	counted_free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+	counted_free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+	counted_free(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+	counted_free(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+	counted_free(p);
+}